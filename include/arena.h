@@ -0,0 +1,29 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A block of memory shared between a parent and all of its forked children,
+ * split into equally sized slots. Each slot holds one frame's pixels, so a
+ * child can render straight into memory the parent can read, without either
+ * side copying the frame.
+ *
+ * The arena also holds a shared pool of spare threads. A process that runs
+ * out of frames gives its threads back to the pool, and any process that
+ * still has work can take them to start extra threads of its own.
+ */
+typedef struct arena arena;
+
+arena* arena_create( int slot_count, size_t slot_size, bool huge_pages );
+void   arena_delete( arena* a );
+
+int*   arena_slot( arena* a, int slot );
+int    arena_slot_count( arena* a );
+bool   arena_huge_pages( arena* a );
+
+bool   arena_take_thread( arena* a );
+void   arena_give_threads( arena* a, int count );
+
+#endif
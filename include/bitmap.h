@@ -4,9 +4,11 @@
 typedef struct bitmap bitmap;
 
 struct bitmap * bitmap_create( int w, int h );
+struct bitmap * bitmap_wrap( int w, int h, int *data );
 void            bitmap_delete( struct bitmap *b );
 struct bitmap * bitmap_load( const char *file );
 int             bitmap_save( struct bitmap *b, const char *file );
+int             bitmap_save_png( struct bitmap *b, const char *file );
 
 int   bitmap_get( struct bitmap *b, int x, int y );
 void  bitmap_set( struct bitmap *b, int x, int y, int value );
@@ -2,6 +2,14 @@
 #define __COLORING_H__
 
 int iteration_to_color( int i, int max );
+int distance_to_color( double distance, double pixel_size );
+int histogram_to_color( double fraction );
+
+typedef struct palette palette;
+
+palette* palette_load( const char* path );
+void     palette_delete( palette* p );
+int      palette_to_color( const palette* p, double ratio );
 
 #endif
 
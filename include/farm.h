@@ -0,0 +1,61 @@
+#ifndef __FARM_H__
+#define __FARM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Spreads the frames of a render across worker processes, on this host or
+ * any other, over TCP. The coordinator splits every frame into bands of rows
+ * and hands them out to whichever workers connect. Each worker renders its
+ * bands on its own pool of threads and sends back their iteration counts,
+ * run-length compressed, which the coordinator colors into the frame. A
+ * frame is saved as soon as its last band comes back.
+ *
+ * Bands held by a worker which disconnects, or which goes quiet for longer
+ * than the timeout, are handed out again to the next free worker. Workers
+ * check in every second while they render, so only a dead or stuck one
+ * goes quiet. If every worker is gone for a while, the coordinator renders
+ * the bands left itself, or gives up if it has no threads to do it with.
+ */
+
+// one frame of the render
+typedef struct
+{
+  double x_min;
+  double x_max;
+  double y_min;
+  double y_max;
+
+  int width;
+  int height;
+  int max;
+
+  const char* file_name;
+}
+farm_frame_t;
+
+typedef struct
+{
+  // how many rows each band covers
+  int tile_rows;
+
+  // how many seconds a worker with bands can go without answering before
+  // it's given up on, or 0 to wait for as long as it takes
+  int timeout;
+
+  // how many threads to render the bands left on here once there are no
+  // workers left, or 0 to fail instead
+  int local_threads;
+}
+farm_options_t;
+
+int    farm_listen( int port );
+bool   farm_coordinate( int listener, farm_frame_t* frames, int frame_count, const farm_options_t* options );
+bool   farm_work( const char* host, int port, int thread_count );
+
+size_t farm_encode( const int* values, int count, unsigned char* out );
+size_t farm_encode_bound( int count );
+bool   farm_decode( const unsigned char* in, size_t size, int* values, int count );
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef __MANDELBROT_H__
+#define __MANDELBROT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <bitmap.h>
+
+/**
+ * libmandel: renders views of the Mandelbrot set on a shared pool of threads.
+ *
+ * A renderer owns the threads. Any number of views can be submitted to it at
+ * once, from any thread, and each submission returns a job which can either
+ * be waited on or report its completion through a callback. Nothing in the
+ * library is global, so several renderers can run side by side.
+ */
+
+typedef struct mandel_renderer mandel_renderer;
+typedef struct mandel_job mandel_job;
+typedef struct mandel_session mandel_session;
+typedef struct mandel_zoom mandel_zoom;
+
+/**
+ * The escape state of every pixel in a view, so that rendering it again with
+ * a larger max can carry on from where the last render stopped, rather than
+ * starting every orbit over from z = 0.
+ */
+typedef struct
+{
+  int width;
+  int height;
+
+  // the max the state was computed with, or 0 if nothing has been computed
+  int max;
+
+  // how many iterations each pixel ran for; any pixel below max escaped
+  int* iterations;
+
+  // the last z of each pixel's orbit, as x, y pairs
+  double* z;
+
+  // if set, iterations and z point into this private mapping of a saved
+  // state, rather than being allocated
+  void* mapping;
+  size_t mapping_size;
+}
+mandel_orbits_t;
+
+/**
+ * What to render, and where to put it. When the view crosses the real axis
+ * and each row lines up with its reflection, only one side is computed and
+ * the other is mirrored from it, since the set is symmetric about the axis.
+ * Views with known pixels are never mirrored.
+ */
+typedef struct
+{
+  // the image being rendered into; its size decides the resolution
+  bitmap* bm;
+
+  double x_min;
+  double x_max;
+
+  double y_min;
+  double y_max;
+
+  int max;
+
+  // if set, pixels are colored by their estimated distance to the set, and
+  // disks which are guaranteed to be outside of the set are filled in
+  // without computing their orbits
+  bool distance_estimation;
+
+  // if set, the escape state of every pixel is read from and written back
+  // to here. Not used with distance estimation
+  mandel_orbits_t* orbits;
+
+  // if set, one flag per pixel; pixels which are flagged already hold their
+  // color and are left alone
+  const unsigned char* known;
+
+  // if set, pixels are colored by histogram equalization, so the palette is
+  // spread over the iterations the image actually has, whatever max is. Not
+  // used with distance estimation, known pixels, or part of a view
+  bool histogram;
+
+  // if frame_height is set, the view is frame_height rows tall, but the
+  // bitmap only holds and renders its rows from first_row on. They get
+  // exactly the counts and colors a render of the whole view would give
+  // them. Not used with distance estimation
+  int first_row;
+  int frame_height;
+
+  // if set, each pixel's count is looked up with lookup( lookup_data, x, y,
+  // max ) rather than iterated, as when a zoom's frames come from its map.
+  // Not used with distance estimation or orbit state
+  int ( *lookup )( const void* data, double x, double y, int max );
+  const void* lookup_data;
+}
+mandel_view_t;
+
+/**
+ * How a view is split up into work items for the pool.
+ */
+typedef struct
+{
+  // without work stealing, the view is split into this many bands
+  int thread_count;
+
+  // if set, the view is split into small tiles which are handed out as
+  // threads become free, rather than one band per thread
+  bool work_stealing;
+
+  // only used without work stealing; splits rows evenly rather than by cost
+  bool uniform_rows;
+
+  // only used with work stealing; how many rows each work item covers
+  int tile_rows;
+
+  // only used with work stealing; the tiles are ranked by their predicted
+  // cost, and the renderer hands out the most expensive tile of any ranked
+  // job first, so many jobs submitted together finish close to the same time
+  bool longest_first;
+}
+mandel_schedule_t;
+
+/**
+ * Lets a renderer temporarily grow past its own threads. While work is
+ * queued, the renderer calls borrow() and, if it returns true, starts an
+ * extra thread which calls release() once there's nothing left to take.
+ */
+typedef struct
+{
+  bool ( *borrow )( void* data );
+  void ( *release )( void* data );
+  void* data;
+
+  // the most extra threads to have running at once
+  int max;
+}
+mandel_lender_t;
+
+/**
+ * Called from one of the pool's threads once a job's view has been rendered.
+ * An empty view has nothing to render, so its callback is run on the
+ * caller's thread before mandel_render() returns. The job then belongs to the
+ * callback, which may delete it.
+ */
+typedef void ( *mandel_callback_t )( mandel_job* job, void* data );
+
+/**
+ * One row of work which isn't part of a view, such as a row of a zoom's map,
+ * run on one of the pool's threads.
+ */
+typedef void ( *mandel_row_t )( void* data, int row );
+
+mandel_renderer* mandel_renderer_create( int thread_count );
+void             mandel_renderer_delete( mandel_renderer* r );
+int              mandel_renderer_threads( mandel_renderer* r );
+void             mandel_renderer_lend( mandel_renderer* r, const mandel_lender_t* lender );
+
+mandel_job*      mandel_render(
+    mandel_renderer* r,
+    const mandel_view_t* view,
+    const mandel_schedule_t* schedule,
+    mandel_callback_t callback,
+    void* data );
+mandel_job*      mandel_render_rows( mandel_renderer* r, int rows, mandel_row_t row, void* data );
+
+void                 mandel_job_wait( mandel_job* job );
+bool                 mandel_job_done( mandel_job* job );
+const mandel_view_t* mandel_job_view( mandel_job* job );
+void                 mandel_job_delete( mandel_job* job );
+
+int    mandel_escape_iterations( double x, double y, int max );
+int    mandel_continue_orbit( double cx, double cy, double* zx, double* zy, int iter, int max );
+double mandel_distance_estimate( double x, double y, int max );
+
+double mandel_predict_cost( const mandel_view_t* view );
+void   mandel_view_snap_to_axis( mandel_view_t* view );
+
+mandel_orbits_t* mandel_orbits_create( int width, int height );
+void             mandel_orbits_delete( mandel_orbits_t* orbits );
+bool             mandel_orbits_save( const mandel_view_t* view, const char* path );
+mandel_orbits_t* mandel_orbits_load( const mandel_view_t* view, const char* path );
+
+mandel_session*      mandel_session_create(
+    mandel_renderer* r,
+    const mandel_view_t* view,
+    const mandel_schedule_t* schedule );
+void                 mandel_session_delete( mandel_session* s );
+const mandel_view_t* mandel_session_view( mandel_session* s );
+int                  mandel_session_pan( mandel_session* s, int dx, int dy );
+int                  mandel_session_zoom_in( mandel_session* s, int factor );
+int                  mandel_session_zoom_out( mandel_session* s, int factor );
+
+mandel_zoom* mandel_zoom_create(
+    mandel_renderer* r,
+    double x_center,
+    double y_center,
+    double scale_min,
+    double scale_max,
+    int width,
+    int height,
+    int max );
+void         mandel_zoom_delete( mandel_zoom* z );
+size_t       mandel_zoom_points( mandel_zoom* z );
+void         mandel_zoom_frame( mandel_zoom* z, mandel_renderer* r, const mandel_view_t* view );
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdbool.h>
+#include <mandelbrot.h>
+
+/**
+ * The scheduling configuration which renders fastest on this machine, as
+ * found by `mandel --autotune`. It's saved per host so that every machine
+ * type keeps its own.
+ */
+typedef mandel_schedule_t profile_t;
+
+bool profile_load( profile_t* profile );
+bool profile_save( const profile_t* profile );
+const char* profile_path();
+
+#endif
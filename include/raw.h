@@ -0,0 +1,57 @@
+#ifndef __RAW_H__
+#define __RAW_H__
+
+#include <stdbool.h>
+#include <mandelbrot.h>
+
+/**
+ * Raw iteration files keep what a render computed rather than its colors, so
+ * the same render can be colored any number of ways without iterating again.
+ *
+ * Files are laid out as:
+ *
+ *   raw_header_t                     80 bytes, see raw.c
+ *   uint64_t offsets[ tiles + 1 ]    only if compressed
+ *   the plane                        at data_offset
+ *
+ * The plane holds one value per pixel in row-major order, starting from
+ * y_min, as one of:
+ *
+ *   RAW_U16     uint16_t iteration counts, capped at 65535
+ *   RAW_U32     uint32_t iteration counts
+ *   RAW_SMOOTH  float, the count plus the fraction of an iteration the
+ *               orbit was from escaping, so colors can change smoothly
+ *
+ * Numbers are in the byte order of the host that wrote the file, which the
+ * header records, and raw_load() turns down files from a host of the other
+ * order. An uncompressed plane starts on a 64 byte boundary and can be used
+ * straight out of a mapping. A compressed plane is
+ * split into tiles of tile_rows rows, each compressed on its own with
+ * farm_encode() so any tile can be read without the others; offsets[ t ] is
+ * where tile t starts in the file, and offsets[ tiles ] is the end of the last.
+ */
+
+#define RAW_U16 1
+#define RAW_U32 2
+#define RAW_SMOOTH 3
+
+// the header's byte order mark, shared with orbit state files. It's written
+// as a number, so a file from a host of the other byte order reads as
+// something else and is turned down
+#define RAW_BYTE_ORDER 0x01020304
+
+typedef struct raw raw;
+
+bool raw_save( const mandel_view_t* view, int precision, int tile_rows, bool compressed, const char* path );
+raw* raw_load( const char* path );
+void raw_delete( raw* r );
+
+int  raw_width( raw* r );
+int  raw_height( raw* r );
+int  raw_precision( raw* r );
+int  raw_tile_rows( raw* r );
+int  raw_tile_count( raw* r );
+void raw_describe( raw* r, mandel_view_t* view );
+bool raw_read_tile( raw* r, int tile, double* values );
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <arena.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// huge pages are 2MiB on every machine we run on
+#define HUGE_PAGE_SIZE ( 2 * 1024 * 1024 )
+
+// lives at the start of the mapping so every process sees the same copy
+typedef struct
+{
+  int spare_threads;
+}
+arena_header_t;
+
+struct arena
+{
+  int slot_count;
+
+  // the distance between the starts of two slots, which is rounded up to the
+  // page size so that no two children ever write to the same page
+  size_t slot_stride;
+
+  size_t size;
+  char* base;
+
+  // the shared header, followed by the first slot on the next page
+  arena_header_t* header;
+  char* slots;
+
+  bool huge_pages;
+};
+
+/**
+ * Map size bytes of anonymous memory which will stay shared after a fork.
+ * Returns NULL if the mapping couldn't be created with the given flags.
+ */
+static char* map_shared( size_t size, unsigned int memfd_flags )
+{
+  int fd = memfd_create( "mandel-arena", memfd_flags );
+  if ( fd < 0 ) return NULL;
+
+  if ( ftruncate( fd, size ) < 0 )
+  {
+    close( fd );
+    return NULL;
+  }
+
+  // MAP_POPULATE faults every page in now, rather than in each child
+  void* base = mmap(
+      NULL,
+      size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      fd,
+      0
+  );
+
+  // the mapping keeps the memory alive on its own
+  close( fd );
+
+  if ( base == MAP_FAILED ) return NULL;
+  return base;
+}
+
+arena* arena_create( int slot_count, size_t slot_size, bool huge_pages )
+{
+  arena* a = malloc( sizeof( *a ) );
+  if ( !a ) return NULL;
+
+  size_t page_size = huge_pages ? HUGE_PAGE_SIZE : ( size_t ) sysconf( _SC_PAGESIZE );
+
+  a->slot_count = slot_count;
+  a->slot_stride = ( slot_size + page_size - 1 ) / page_size * page_size;
+  a->size = page_size + a->slot_stride * slot_count;
+  a->huge_pages = huge_pages;
+  a->base = NULL;
+
+  if ( huge_pages )
+  {
+    a->base = map_shared( a->size, MFD_HUGETLB );
+
+    // there might not be any huge pages reserved, so fall back to normal ones
+    if ( !a->base )
+    {
+      fprintf( stderr, "arena: huge pages unavailable, using normal pages\n" );
+      free( a );
+      return arena_create( slot_count, slot_size, false );
+    }
+  }
+  else
+  {
+    a->base = map_shared( a->size, 0 );
+  }
+
+  if ( !a->base )
+  {
+    free( a );
+    return NULL;
+  }
+
+  a->header = ( arena_header_t* ) a->base;
+  a->header->spare_threads = 0;
+  a->slots = a->base + page_size;
+
+  return a;
+}
+
+void arena_delete( arena* a )
+{
+  munmap( a->base, a->size );
+  free( a );
+}
+
+int* arena_slot( arena* a, int slot )
+{
+  return ( int* ) ( a->slots + a->slot_stride * slot );
+}
+
+int arena_slot_count( arena* a )
+{
+  return a->slot_count;
+}
+
+bool arena_huge_pages( arena* a )
+{
+  return a->huge_pages;
+}
+
+/**
+ * Try to claim one of the spare threads. Returns false if there are none.
+ */
+bool arena_take_thread( arena* a )
+{
+  int spare = __atomic_load_n( &a->header->spare_threads, __ATOMIC_RELAXED );
+
+  while ( spare > 0 )
+  {
+    if ( __atomic_compare_exchange_n(
+          &a->header->spare_threads,
+          &spare,
+          spare - 1,
+          false,
+          __ATOMIC_ACQ_REL,
+          __ATOMIC_RELAXED ) )
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Hand count threads back to the pool so other processes can use them.
+ */
+void arena_give_threads( arena* a, int count )
+{
+  __atomic_add_fetch( &a->header->spare_threads, count, __ATOMIC_ACQ_REL );
+}
@@ -1,12 +1,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <bitmap.h>
 
 struct bitmap {
   int width;
   int height;
   int *data;
+  int owns_data;
 };
 
 bitmap*  bitmap_create( int w, int h )
@@ -24,13 +30,31 @@ bitmap*  bitmap_create( int w, int h )
 
   m->width = w;
   m->height = h;
+  m->owns_data = 1;
+
+  return m;
+}
+
+/* Creates a bitmap over pixels owned by someone else, e.g. a shared mapping.
+   The pixels are left alone when the bitmap is deleted. */
+bitmap*  bitmap_wrap( int w, int h, int *data )
+{
+  bitmap* m;
+
+  m = malloc(sizeof *m);
+  if(!m) return 0;
+
+  m->data = data;
+  m->width = w;
+  m->height = h;
+  m->owns_data = 0;
 
   return m;
 }
 
 void bitmap_delete( bitmap* m )
 {
-  free(m->data);
+  if(m->owns_data) free(m->data);
   free(m);
 }
 
@@ -97,15 +121,144 @@ struct bmp_header {
   int  icolors;
 };
 
+/* Turn pixels into BGR triples. Each version may also scribble over the
+   bytes just past what it was asked for, as long as they're still inside
+   the row, since the next pixels overwrite them. */
+static void pack_row_scalar( const int *pixels, unsigned char *out, int count )
+{
+  int i;
+  for(i=0;i<count;i++) {
+    int rgba = pixels[i];
+    *out++ = GET_BLUE(rgba);
+    *out++ = GET_GREEN(rgba);
+    *out++ = GET_RED(rgba);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* 4 pixels at a time, storing 16 bytes of which the first 12 are theirs */
+__attribute__((target("ssse3")))
+static void pack_row_ssse3( const int *pixels, unsigned char *out, int count )
+{
+  const __m128i drop_alpha = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+  int i = 0;
+
+  for(;i+6<=count;i+=4) {
+    __m128i p = _mm_loadu_si128((const __m128i*)(pixels+i));
+    _mm_storeu_si128((__m128i*)(out+3*i),_mm_shuffle_epi8(p,drop_alpha));
+  }
+  pack_row_scalar(pixels+i,out+3*i,count-i);
+}
+
+/* 8 pixels at a time; the shuffle stays within each half, so the two
+   halves' 12 bytes are then moved next to each other */
+__attribute__((target("avx2")))
+static void pack_row_avx2( const int *pixels, unsigned char *out, int count )
+{
+  const __m256i drop_alpha = _mm256_setr_epi8(
+      0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+      0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+  const __m256i close_gap = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+  int i = 0;
+
+  for(;i+11<=count;i+=8) {
+    __m256i p = _mm256_loadu_si256((const __m256i*)(pixels+i));
+    p = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p,drop_alpha),close_gap);
+    _mm256_storeu_si256((__m256i*)(out+3*i),p);
+  }
+  pack_row_ssse3(pixels+i,out+3*i,count-i);
+}
+#endif
+
+typedef void (*pack_row_fn)( const int *pixels, unsigned char *out, int count );
+
+static pack_row_fn pick_pack_row( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("avx2"))  return pack_row_avx2;
+  if(__builtin_cpu_supports("ssse3")) return pack_row_ssse3;
+#endif
+  return pack_row_scalar;
+}
+
+/* a band of rows to be packed into a BMP's pixel array */
+struct pack_band {
+  const bitmap *m;
+  unsigned char *image;
+  int stride;
+  int row_start;
+  int row_end;
+  pack_row_fn pack_row;
+};
+
+static void *pack_band( void *arg )
+{
+  struct pack_band *band = arg;
+  int j;
+
+  for(j=band->row_start;j<band->row_end;j++) {
+    unsigned char *row = band->image + (size_t)j*band->stride;
+    int used = band->m->width*3;
+
+    band->pack_row(band->m->data + (size_t)j*band->m->width,row,band->m->width);
+    memset(row+used,0,band->stride-used);
+  }
+  return 0;
+}
+
+/* images smaller than this many pixels per thread are packed on one thread,
+   since starting more would take longer than the packing */
+#define PACK_BAND_PIXELS (1<<20)
+#define PACK_MAX_THREADS 16
+
+/* Pack every row into image, the way the BMP stores them, splitting the rows
+   between threads when the image is big enough to be worth it. */
+static void pack_image( const bitmap *m, unsigned char *image, int stride )
+{
+  struct pack_band bands[PACK_MAX_THREADS];
+  pthread_t threads[PACK_MAX_THREADS];
+  int started[PACK_MAX_THREADS];
+  size_t pixels = (size_t)m->width*m->height;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int count, i;
+
+  count = pixels/PACK_BAND_PIXELS;
+  if(count>cpus) count = cpus;
+  if(count>m->height) count = m->height;
+  if(count>PACK_MAX_THREADS) count = PACK_MAX_THREADS;
+  if(count<1) count = 1;
+
+  for(i=0;i<count;i++) {
+    bands[i].m = m;
+    bands[i].image = image;
+    bands[i].stride = stride;
+    bands[i].row_start = (long)m->height*i/count;
+    bands[i].row_end = (long)m->height*(i+1)/count;
+    bands[i].pack_row = pick_pack_row();
+  }
+
+  /* the first band is packed here, and any band whose thread can't be
+     started is packed here too */
+  for(i=1;i<count;i++) started[i] = pthread_create(threads+i,0,pack_band,bands+i)==0;
+  pack_band(bands);
+  for(i=1;i<count;i++) {
+    if(started[i]) pthread_join(threads[i],0);
+    else pack_band(bands+i);
+  }
+}
+
 int bitmap_save( bitmap* m, const char *path )
 {
-  FILE *file;
   struct bmp_header header;
-  int i, j;
-  unsigned char *scanline, *s;
+  struct iovec parts[2];
+  unsigned char *image;
+  size_t image_size;
+  int fd, left, saved;
 
-  file = fopen(path,"wb");
-  if(!file) return 0;
+  /* if the scanline is not a multiple of four, round it up. */
+  int stride = (m->width*3+3)&~3;
 
   memset(&header,0,sizeof(header));
   header.magic1 = 'B';
@@ -122,30 +275,183 @@ int bitmap_save( bitmap* m, const char *path )
   header.xres = 1000;
   header.yres = 1000;
 
-  fwrite(&header,1,sizeof(header),file);
+  image_size = (size_t)stride*m->height;
+  image = malloc(image_size ? image_size : 1);
+  if(!image) return 0;
 
-  /* if the scanline is not a multiple of four, round it up. */
-  int padlength = 4 - (m->width*3)%4;
-  if(padlength==4) padlength=0;
+  pack_image(m,image,stride);
+
+  fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if(fd<0) {
+    free(image);
+    return 0;
+  }
+
+  /* the whole file goes out in as few calls as the kernel will take it */
+  parts[0].iov_base = &header;
+  parts[0].iov_len = sizeof(header);
+  parts[1].iov_base = image;
+  parts[1].iov_len = image_size;
+  left = 2;
+  saved = 1;
+
+  while(left>0) {
+    struct iovec *part = parts+2-left;
+    ssize_t written = writev(fd,part,left);
+
+    if(written<0) {
+      if(errno==EINTR) continue;
+      saved = 0;
+      break;
+    }
+
+    while(left>0 && (size_t)written>=part->iov_len) {
+      written -= part->iov_len;
+      part++;
+      left--;
+    }
+    if(left>0) {
+      part->iov_base = (char*)part->iov_base+written;
+      part->iov_len -= written;
+    }
+  }
+
+  free(image);
+  if(close(fd)<0) saved = 0;
+  return saved;
+}
+
+/* PNG needs a CRC on every chunk, and an Adler-32 on the zlib stream. */
+static unsigned int png_crc( unsigned int crc, const unsigned char *data, size_t length )
+{
+  static unsigned int table[256];
+  static int table_ready = 0;
+  size_t i;
+  int k;
+
+  if(!table_ready) {
+    for(i=0;i<256;i++) {
+      unsigned int c = i;
+      for(k=0;k<8;k++) c = (c&1) ? 0xedb88320u^(c>>1) : c>>1;
+      table[i] = c;
+    }
+    table_ready = 1;
+  }
+
+  crc = ~crc;
+  for(i=0;i<length;i++) crc = table[(crc^data[i])&0xff]^(crc>>8);
+  return ~crc;
+}
+
+static void png_put32( unsigned char *out, unsigned int value )
+{
+  out[0] = value>>24;
+  out[1] = value>>16;
+  out[2] = value>>8;
+  out[3] = value;
+}
+
+static int png_chunk( FILE *file, const char *type, const unsigned char *data, size_t length )
+{
+  unsigned char word[4];
+  unsigned int crc;
+
+  png_put32(word,length);
+  crc = png_crc(0,(const unsigned char*)type,4);
+  crc = png_crc(crc,data,length);
+
+  if(fwrite(word,1,4,file)!=4) return 0;
+  if(fwrite(type,1,4,file)!=4) return 0;
+  if(length && fwrite(data,1,length,file)!=length) return 0;
+  png_put32(word,crc);
+  return fwrite(word,1,4,file)==4;
+}
+
+/* Saves a 24-bit PNG. The pixels are stored rather than deflated, so this
+   needs no zlib, and the rows are flipped to match what bitmap_save writes. */
+int bitmap_save_png( bitmap* m, const char *path )
+{
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  unsigned char ihdr[13];
+  size_t row = 1 + (size_t)m->width*3;
+  size_t raw_size = row*m->height;
+  size_t blocks = raw_size ? (raw_size+65534)/65535 : 1;
+  size_t idat_size = 2 + blocks*5 + raw_size + 4;
+  unsigned char *raw, *idat, *s;
+  unsigned int a = 1, b = 0;
+  size_t i, offset;
+  int j, ok;
+  FILE *file;
 
-  scanline = malloc(header.width*3);
+  raw = malloc(raw_size ? raw_size : 1);
+  idat = malloc(idat_size);
+  if(!raw || !idat) {
+    free(raw);
+    free(idat);
+    return 0;
+  }
 
+  /* every row starts with filter type 0, meaning no filtering */
   for(j=0;j<m->height;j++) {
-    s = scanline;
-    for(i=0;i<m->width;i++) {
-      int rgba = bitmap_get(m,i,j);
-      *s++ = GET_BLUE(rgba);
-      *s++ = GET_GREEN(rgba);
+    s = raw + row*j;
+    *s++ = 0;
+    for(i=0;i<(size_t)m->width;i++) {
+      int rgba = m->data[(m->height-1-j)*m->width+i];
       *s++ = GET_RED(rgba);
+      *s++ = GET_GREEN(rgba);
+      *s++ = GET_BLUE(rgba);
     }
-    fwrite(scanline,1,m->width*3,file);
-    fwrite(scanline,1,padlength,file);
   }
 
-  free(scanline);
+  /* a zlib stream of stored deflate blocks */
+  s = idat;
+  *s++ = 0x78;
+  *s++ = 0x01;
+  offset = 0;
+  do {
+    size_t length = raw_size-offset < 65535 ? raw_size-offset : 65535;
+    *s++ = offset+length==raw_size ? 1 : 0;
+    *s++ = length&0xff;
+    *s++ = length>>8;
+    *s++ = ~length&0xff;
+    *s++ = (~length>>8)&0xff;
+    memcpy(s,raw+offset,length);
+    s += length;
+    offset += length;
+  } while(offset<raw_size);
+
+  for(i=0;i<raw_size;i++) {
+    a = (a+raw[i])%65521;
+    b = (b+a)%65521;
+  }
+  png_put32(s,(b<<16)|a);
+  s += 4;
+
+  png_put32(ihdr,m->width);
+  png_put32(ihdr+4,m->height);
+  ihdr[8] = 8;   /* bits per channel */
+  ihdr[9] = 2;   /* truecolor */
+  ihdr[10] = 0;
+  ihdr[11] = 0;
+  ihdr[12] = 0;
 
-  fclose(file);
-  return 1;
+  file = fopen(path,"wb");
+  if(!file) {
+    free(raw);
+    free(idat);
+    return 0;
+  }
+
+  ok = fwrite(signature,1,8,file)==8 &&
+    png_chunk(file,"IHDR",ihdr,13) &&
+    png_chunk(file,"IDAT",idat,s-idat) &&
+    png_chunk(file,"IEND",NULL,0);
+
+  free(raw);
+  free(idat);
+
+  if(fclose(file)!=0) ok = 0;
+  return ok;
 }
 
 /*
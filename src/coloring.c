@@ -1,5 +1,7 @@
 #include <coloring.h>
 #include <bitmap.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <math.h>
 
 #define SMOOTHING 1
@@ -18,6 +20,16 @@
 #define SCHEME_ENTRIES 18
 static const int color_scheme[ SCHEME_ENTRIES + 1 ][ 3 ];
 
+// a palette read from a file, blended the same way as the built in one
+struct palette
+{
+  int segments;
+  int ( *colors )[ 3 ];
+};
+
+static int palette_color( double ratio );
+static int blend( const int ( *colors )[ 3 ], int segments, double ratio );
+
 int iteration_to_color( int i, int max )
 {
   double ratio = INTERPOLATE( ( double ) i, ( double ) max );
@@ -46,6 +58,129 @@ int iteration_to_color( int i, int max )
   }
 }
 
+/**
+ * Colors a point by its estimated distance to the set, where the distance is
+ * measured in the same units as pixel_size. Points inside the set (negative
+ * distance) are black, and points get brighter the farther they are from the
+ * boundary.
+ */
+int distance_to_color( double distance, double pixel_size )
+{
+  if ( distance < 0 )
+  {
+    return MAKE_RGBA( 0, 0, 0, 0 );
+  }
+
+  // how many pixels we are away from the boundary, squashed into [0, 1)
+  double pixels = distance / pixel_size;
+  double ratio = 1.0 - 1.0 / ( 1.0 + SQRT( pixels ) / 4.0 );
+
+  return palette_color( ratio );
+}
+
+/**
+ * Colors an escaped point by where it falls in the image's histogram, where
+ * fraction is the share of escaped points which escaped faster than it did.
+ * This spreads the whole palette evenly over the image, however large max is.
+ */
+int histogram_to_color( double fraction )
+{
+  return palette_color( 1.0 - fraction );
+}
+
+/**
+ * Read a palette from a file with one "r g b" entry per line, from the color
+ * at ratio 0 to the color at ratio 1. Lines starting with # are skipped.
+ * Returns NULL if there aren't at least two entries.
+ */
+palette* palette_load( const char* path )
+{
+  FILE* file = fopen( path, "r" );
+  if ( !file ) return NULL;
+
+  palette* p = calloc( 1, sizeof( *p ) );
+  int capacity = 0;
+  int count = 0;
+
+  char line[ 256 ];
+  while ( fgets( line, sizeof( line ), file ) )
+  {
+    int r, g, b;
+    if ( line[ 0 ] == '#' || sscanf( line, "%d %d %d", &r, &g, &b ) != 3 ) continue;
+
+    if ( count == capacity )
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      p->colors = realloc( p->colors, sizeof( *p->colors ) * capacity );
+    }
+
+    p->colors[ count ][ 0 ] = r < 0 ? 0 : r > 255 ? 255 : r;
+    p->colors[ count ][ 1 ] = g < 0 ? 0 : g > 255 ? 255 : g;
+    p->colors[ count ][ 2 ] = b < 0 ? 0 : b > 255 ? 255 : b;
+    count++;
+  }
+  fclose( file );
+
+  if ( count < 2 )
+  {
+    palette_delete( p );
+    return NULL;
+  }
+
+  p->segments = count - 1;
+  return p;
+}
+
+void palette_delete( palette* p )
+{
+  free( p->colors );
+  free( p );
+}
+
+/**
+ * The color at ratio, in [0, 1], along the given palette, or along the built
+ * in one if p is NULL.
+ */
+int palette_to_color( const palette* p, double ratio )
+{
+  if ( !p ) return palette_color( ratio );
+
+  return blend( ( const int ( * )[ 3 ] ) p->colors, p->segments, ratio );
+}
+
+/**
+ * Blend smoothly between the two palette entries around ratio, in [0, 1).
+ */
+static int palette_color( double ratio )
+{
+  return blend( color_scheme, SCHEME_ENTRIES, ratio );
+}
+
+/**
+ * Blend between the two of the segments + 1 colors around ratio.
+ */
+static int blend( const int ( *colors )[ 3 ], int segments, double ratio )
+{
+  if ( ratio < 0 ) ratio = 0;
+
+  double position = segments * ratio;
+  if ( position > segments ) position = segments;
+
+  int index = ( int ) position;
+  if ( index == segments ) index = segments - 1;
+  double mixing = position - index;
+
+  const int* lower = colors[ index ];
+  const int* upper = colors[ index + 1 ];
+
+  return MAKE_RGBA(
+      ( lower[ 0 ] * ( 1 - mixing ) ) + ( upper[ 0 ] * mixing ),
+      ( lower[ 1 ] * ( 1 - mixing ) ) + ( upper[ 1 ] * mixing ),
+      ( lower[ 2 ] * ( 1 - mixing ) ) + ( upper[ 2 ] * mixing ),
+      0
+  );
+}
+
 //
 // Color Scheme
 //
@@ -0,0 +1,1081 @@
+#define _GNU_SOURCE
+
+#include <farm.h>
+#include <mandelbrot.h>
+#include <coloring.h>
+#include <bitmap.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Every message is an 8 byte header followed by its payload:
+//
+//   uint32_t type
+//   uint32_t payload size
+//
+// with every number sent little endian, whatever the host. The payloads are:
+//
+//   HELLO   worker -> coordinator  magic, version, thread count
+//   TILE    coordinator -> worker  tile id, width, frame height, first row,
+//                                  row count, max, and the whole frame's
+//                                  x_min, x_max, y_min, y_max
+//   RESULT  worker -> coordinator  tile id, pixel count, encoded counts
+//   DONE    coordinator -> worker  nothing; the worker should exit
+//   BUSY    worker -> coordinator  nothing; sent every second while a tile
+//                                  renders, so a slow tile isn't mistaken
+//                                  for a dead worker
+//
+// A tile carries the bounds of its whole frame rather than of its rows, so
+// its pixels land on exactly the points a render of the frame would use.
+
+#define FARM_MAGIC 0x4d46524d
+#define FARM_VERSION 2
+
+#define MESSAGE_HELLO 1
+#define MESSAGE_TILE 2
+#define MESSAGE_RESULT 3
+#define MESSAGE_DONE 4
+#define MESSAGE_BUSY 5
+
+#define HEADER_SIZE 8
+#define HELLO_SIZE 12
+#define TILE_SIZE 56
+
+// anything bigger than this can't be a real message
+#define MAX_PAYLOAD ( 256 * 1024 * 1024 )
+
+// how many tiles each worker holds at once, so it has the next one to hand
+// while the last one's result is on its way back
+#define PIPELINE 2
+
+// how long a worker keeps trying to reach a coordinator which isn't up yet
+#define CONNECT_ATTEMPTS 100
+#define CONNECT_DELAY_MS 100
+
+// how often a worker says it's still busy with a tile
+#define BUSY_INTERVAL_MS 1000
+
+// how long the coordinator goes without any workers at all before it gives
+// up on them, and renders what's left itself or fails
+#define LONELY_SECONDS 10
+
+// how long a connection gets to say HELLO before it's closed, so a stray
+// one can't pass for a worker
+#define HELLO_SECONDS 5
+
+typedef struct
+{
+  int frame;
+  int row_start;
+  int row_end;
+}
+tile_t;
+
+// the rows of a frame one tile covers, as its TILE message describes them
+typedef struct
+{
+  int width;
+  int frame_height;
+  int row_start;
+  int rows;
+  int max;
+
+  double x_min;
+  double x_max;
+  double y_min;
+  double y_max;
+}
+band_t;
+
+// the coordinator's view of one connected worker
+typedef struct
+{
+  // -1 once the worker is gone
+  int fd;
+  bool hello;
+
+  // whatever has arrived that isn't a whole message yet
+  unsigned char* buffer;
+  size_t used;
+  size_t capacity;
+
+  int tiles[ PIPELINE ];
+  int in_flight;
+
+  time_t last_heard;
+  time_t connected;
+}
+worker_t;
+
+// everything the coordinator keeps track of
+typedef struct
+{
+  farm_frame_t* frames;
+  bitmap** images;
+  int* frames_remaining;
+
+  tile_t* tiles;
+  int tile_count;
+  int tiles_done;
+
+  // tiles are handed out in order, except for retried ones, which go first
+  int next_tile;
+  int* retries;
+  int retry_count;
+
+  worker_t* workers;
+  int worker_count;
+
+  const farm_options_t* options;
+}
+coordinator_t;
+
+//
+// Encoding
+//
+
+static void put_u32( unsigned char* out, uint32_t value )
+{
+  out[ 0 ] = value;
+  out[ 1 ] = value >> 8;
+  out[ 2 ] = value >> 16;
+  out[ 3 ] = value >> 24;
+}
+
+static uint32_t get_u32( const unsigned char* in )
+{
+  return ( uint32_t ) in[ 0 ] |
+    ( ( uint32_t ) in[ 1 ] << 8 ) |
+    ( ( uint32_t ) in[ 2 ] << 16 ) |
+    ( ( uint32_t ) in[ 3 ] << 24 );
+}
+
+static void put_double( unsigned char* out, double value )
+{
+  uint64_t bits;
+  memcpy( &bits, &value, sizeof( bits ) );
+
+  put_u32( out, bits );
+  put_u32( out + 4, bits >> 32 );
+}
+
+static double get_double( const unsigned char* in )
+{
+  uint64_t bits = get_u32( in ) | ( ( uint64_t ) get_u32( in + 4 ) << 32 );
+
+  double value;
+  memcpy( &value, &bits, sizeof( value ) );
+  return value;
+}
+
+static unsigned char* put_varint( unsigned char* out, uint64_t value )
+{
+  while ( value >= 0x80 )
+  {
+    *out++ = ( value & 0x7f ) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+
+  return out;
+}
+
+static const unsigned char* get_varint( const unsigned char* in, const unsigned char* end, uint64_t* value )
+{
+  *value = 0;
+
+  int shift;
+  for ( shift = 0; in < end && shift < 64; shift += 7 )
+  {
+    unsigned char byte = *in++;
+    *value |= ( uint64_t ) ( byte & 0x7f ) << shift;
+
+    if ( !( byte & 0x80 ) ) return in;
+  }
+
+  return NULL;
+}
+
+/**
+ * The most bytes farm_encode() can need for count values.
+ */
+size_t farm_encode_bound( int count )
+{
+  // a run length of up to 5 bytes, and a difference of up to 10
+  return ( size_t ) count * 15;
+}
+
+/**
+ * Compress count iteration counts into out as runs of equal values, each
+ * stored as its length and its difference from the last run's value. Whole
+ * runs of the set's interior, and the slow gradients outside of it, shrink
+ * to a few bytes. Returns the number of bytes written.
+ */
+size_t farm_encode( const int* values, int count, unsigned char* out )
+{
+  unsigned char* start = out;
+  int64_t previous = 0;
+
+  int i = 0;
+  while ( i < count )
+  {
+    int run = 1;
+    while ( i + run < count && values[ i + run ] == values[ i ] ) run++;
+
+    // zigzag the difference so small negative ones stay small too
+    int64_t delta = values[ i ] - previous;
+    uint64_t zigzag = ( ( uint64_t ) delta << 1 ) ^ ( uint64_t ) ( delta >> 63 );
+
+    out = put_varint( out, run );
+    out = put_varint( out, zigzag );
+
+    previous = values[ i ];
+    i += run;
+  }
+
+  return out - start;
+}
+
+/**
+ * Undo farm_encode(), returning false unless in holds exactly count values.
+ */
+bool farm_decode( const unsigned char* in, size_t size, int* values, int count )
+{
+  const unsigned char* end = in + size;
+  int64_t previous = 0;
+
+  int i = 0;
+  while ( i < count )
+  {
+    uint64_t run, zigzag;
+    in = get_varint( in, end, &run );
+    if ( !in ) return false;
+    in = get_varint( in, end, &zigzag );
+    if ( !in ) return false;
+
+    if ( run == 0 || run > ( uint64_t ) ( count - i ) ) return false;
+
+    int64_t delta = ( int64_t ) ( zigzag >> 1 ) ^ -( int64_t ) ( zigzag & 1 );
+    previous += delta;
+
+    uint64_t k;
+    for ( k = 0; k < run; k++ )
+    {
+      values[ i++ ] = previous;
+    }
+  }
+
+  return in == end;
+}
+
+//
+// Messages
+//
+
+static bool write_full( int fd, const unsigned char* data, size_t size )
+{
+  while ( size > 0 )
+  {
+    // a worker which has gone away shouldn't take the coordinator with it
+    ssize_t written = send( fd, data, size, MSG_NOSIGNAL );
+    if ( written < 0 && errno == EINTR ) continue;
+
+    // the coordinator's sockets don't block, so give a full one a moment
+    if ( written < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+      struct pollfd writable = { fd, POLLOUT, 0 };
+      if ( poll( &writable, 1, 1000 ) <= 0 ) return false;
+      continue;
+    }
+    if ( written <= 0 ) return false;
+
+    data += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+static bool read_full( int fd, unsigned char* data, size_t size )
+{
+  while ( size > 0 )
+  {
+    ssize_t got = read( fd, data, size );
+    if ( got < 0 && errno == EINTR ) continue;
+    if ( got <= 0 ) return false;
+
+    data += got;
+    size -= got;
+  }
+
+  return true;
+}
+
+static bool send_message( int fd, uint32_t type, const unsigned char* payload, size_t size )
+{
+  unsigned char header[ HEADER_SIZE ];
+  put_u32( header, type );
+  put_u32( header + 4, size );
+
+  return write_full( fd, header, HEADER_SIZE ) &&
+    ( size == 0 || write_full( fd, payload, size ) );
+}
+
+/**
+ * Block until a whole message arrives, returning its payload, which the
+ * caller frees. Returns NULL if the connection closed or broke.
+ */
+static unsigned char* receive_message( int fd, uint32_t* type, size_t* size )
+{
+  unsigned char header[ HEADER_SIZE ];
+  if ( !read_full( fd, header, HEADER_SIZE ) ) return NULL;
+
+  *type = get_u32( header );
+  *size = get_u32( header + 4 );
+  if ( *size > MAX_PAYLOAD ) return NULL;
+
+  unsigned char* payload = malloc( *size ? *size : 1 );
+  if ( !read_full( fd, payload, *size ) )
+  {
+    free( payload );
+    return NULL;
+  }
+
+  return payload;
+}
+
+//
+// Bands
+//
+
+// how a band's render tells whoever waits on it that it's finished
+typedef struct
+{
+  pthread_mutex_t m;
+  pthread_cond_t c;
+  bool done;
+}
+band_wait_t;
+
+static void band_finished( mandel_job* job, void* data )
+{
+  band_wait_t* wait = data;
+
+  mandel_job_delete( job );
+
+  pthread_mutex_lock( &wait->m );
+  wait->done = true;
+  pthread_cond_signal( &wait->c );
+  pthread_mutex_unlock( &wait->m );
+}
+
+/**
+ * Render the band's iteration counts on the renderer, exactly as a render of
+ * its whole frame would compute them, and return them in an orbit state the
+ * caller deletes. If given, busy is called every BUSY_INTERVAL_MS until the
+ * band is done.
+ */
+static mandel_orbits_t* band_render( mandel_renderer* renderer, const band_t* band, void ( *busy )( void* data ), void* data )
+{
+  // the orbit state is the only place the renderer leaves iteration counts
+  mandel_orbits_t* orbits = mandel_orbits_create( band->width, band->rows );
+
+  mandel_view_t view = {
+    .bm = bitmap_create( band->width, band->rows ),
+    .max = band->max,
+    .x_min = band->x_min,
+    .x_max = band->x_max,
+    .y_min = band->y_min,
+    .y_max = band->y_max,
+    .distance_estimation = false,
+    .orbits = orbits,
+    .first_row = band->row_start,
+    .frame_height = band->frame_height
+  };
+
+  mandel_schedule_t schedule = {
+    .thread_count = mandel_renderer_threads( renderer ),
+    .work_stealing = true,
+    .uniform_rows = false,
+    .tile_rows = 1
+  };
+
+  band_wait_t wait = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+
+  mandel_render( renderer, &view, &schedule, band_finished, &wait );
+
+  pthread_mutex_lock( &wait.m );
+  while ( !wait.done )
+  {
+    struct timespec deadline;
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += BUSY_INTERVAL_MS / 1000;
+    deadline.tv_nsec += ( BUSY_INTERVAL_MS % 1000 ) * 1000 * 1000;
+    if ( deadline.tv_nsec >= 1000 * 1000 * 1000 )
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+
+    if ( pthread_cond_timedwait( &wait.c, &wait.m, &deadline ) == ETIMEDOUT && !wait.done && busy )
+    {
+      pthread_mutex_unlock( &wait.m );
+      busy( data );
+      pthread_mutex_lock( &wait.m );
+    }
+  }
+  pthread_mutex_unlock( &wait.m );
+
+  pthread_mutex_destroy( &wait.m );
+  pthread_cond_destroy( &wait.c );
+  bitmap_delete( view.bm );
+
+  return orbits;
+}
+
+//
+// Coordinator
+//
+
+static void coordinator_save( coordinator_t* c, int frame );
+static void coordinator_band( coordinator_t* c, int t, band_t* band );
+static void coordinator_store( coordinator_t* c, int t, const int* values );
+static bool coordinator_render_rest( coordinator_t* c );
+static void coordinator_assign( coordinator_t* c, worker_t* w );
+static void coordinator_drop( coordinator_t* c, worker_t* w );
+static bool coordinator_read( coordinator_t* c, worker_t* w );
+static bool coordinator_handle( coordinator_t* c, worker_t* w, uint32_t type, const unsigned char* payload, size_t size );
+
+/**
+ * Start listening for workers on port, on every interface. Returns the
+ * socket, or -1 with errno set.
+ */
+int farm_listen( int port )
+{
+  int fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( fd < 0 ) return -1;
+
+  int yes = 1;
+  setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( yes ) );
+
+  struct sockaddr_in address;
+  memset( &address, 0, sizeof( address ) );
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl( INADDR_ANY );
+  address.sin_port = htons( port );
+
+  if ( bind( fd, ( struct sockaddr* ) &address, sizeof( address ) ) < 0 ||
+       listen( fd, 64 ) < 0 )
+  {
+    int error = errno;
+    close( fd );
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Render every frame on whichever workers connect to listener, saving each
+ * frame as it completes. Returns once every frame has been saved, which
+ * could be never if no workers ever connect.
+ */
+bool farm_coordinate( int listener, farm_frame_t* frames, int frame_count, const farm_options_t* options )
+{
+  coordinator_t c;
+  memset( &c, 0, sizeof( c ) );
+  c.frames = frames;
+  c.options = options;
+
+  int tile_rows = options->tile_rows < 1 ? 1 : options->tile_rows;
+
+  c.images = calloc( frame_count ? frame_count : 1, sizeof( bitmap* ) );
+  c.frames_remaining = calloc( frame_count ? frame_count : 1, sizeof( int ) );
+
+  int f;
+  for ( f = 0; f < frame_count; f++ )
+  {
+    if ( frames[ f ].width > 0 && frames[ f ].height > 0 )
+    {
+      c.tile_count += ( frames[ f ].height + tile_rows - 1 ) / tile_rows;
+    }
+  }
+
+  c.tiles = malloc( sizeof( tile_t ) * ( c.tile_count ? c.tile_count : 1 ) );
+  c.retries = malloc( sizeof( int ) * ( c.tile_count ? c.tile_count : 1 ) );
+
+  int t = 0;
+  for ( f = 0; f < frame_count; f++ )
+  {
+    c.images[ f ] = bitmap_create( frames[ f ].width, frames[ f ].height );
+
+    // there's nothing to wait for in an empty frame
+    if ( frames[ f ].width <= 0 || frames[ f ].height <= 0 )
+    {
+      coordinator_save( &c, f );
+      continue;
+    }
+
+    int row;
+    for ( row = 0; row < frames[ f ].height; row += tile_rows )
+    {
+      c.tiles[ t ].frame = f;
+      c.tiles[ t ].row_start = row;
+      c.tiles[ t ].row_end = row + tile_rows < frames[ f ].height ? row + tile_rows : frames[ f ].height;
+      c.frames_remaining[ f ]++;
+      t++;
+    }
+  }
+
+  struct pollfd* fds = NULL;
+  int fds_capacity = 0;
+
+  time_t lonely_since = time( NULL );
+
+  while ( c.tiles_done < c.tile_count )
+  {
+    if ( fds_capacity < c.worker_count + 1 )
+    {
+      fds_capacity = ( c.worker_count + 1 ) * 2;
+      fds = realloc( fds, sizeof( struct pollfd ) * fds_capacity );
+    }
+
+    fds[ 0 ].fd = listener;
+    fds[ 0 ].events = POLLIN;
+
+    int i;
+    for ( i = 0; i < c.worker_count; i++ )
+    {
+      fds[ i + 1 ].fd = c.workers[ i ].fd;
+      fds[ i + 1 ].events = POLLIN;
+      fds[ i + 1 ].revents = 0;
+    }
+
+    // wake up every second to check on quiet workers
+    int ready = poll( fds, c.worker_count + 1, 1000 );
+    if ( ready < 0 )
+    {
+      if ( errno == EINTR ) continue;
+      perror( "farm: poll failed" );
+      break;
+    }
+
+    time_t now = time( NULL );
+
+    // only the workers which were there before accepting were polled
+    int polled = c.worker_count;
+
+    if ( fds[ 0 ].revents & POLLIN )
+    {
+      int fd = accept( listener, NULL, NULL );
+      if ( fd >= 0 )
+      {
+        fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+        int yes = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof( yes ) );
+
+        c.workers = realloc( c.workers, sizeof( worker_t ) * ( c.worker_count + 1 ) );
+        worker_t* w = c.workers + c.worker_count++;
+        memset( w, 0, sizeof( *w ) );
+        w->fd = fd;
+        w->last_heard = now;
+        w->connected = now;
+      }
+    }
+
+    for ( i = 0; i < polled; i++ )
+    {
+      worker_t* w = c.workers + i;
+      if ( w->fd < 0 || !fds[ i + 1 ].revents ) continue;
+
+      w->last_heard = now;
+      if ( !coordinator_read( &c, w ) )
+      {
+        coordinator_drop( &c, w );
+      }
+    }
+
+    for ( i = 0; i < c.worker_count; i++ )
+    {
+      worker_t* w = c.workers + i;
+      if ( w->fd < 0 ) continue;
+
+      if ( !w->hello && now - w->connected > HELLO_SECONDS )
+      {
+        fprintf( stderr, "farm: connection %d never said hello, closing it\n", i );
+        coordinator_drop( &c, w );
+        continue;
+      }
+
+      if ( options->timeout > 0 && w->in_flight > 0 && now - w->last_heard > options->timeout )
+      {
+        fprintf( stderr, "farm: worker %d went quiet, handing its tiles out again\n", i );
+        coordinator_drop( &c, w );
+        continue;
+      }
+
+      // tiles from dropped workers might have become free
+      coordinator_assign( &c, w );
+    }
+
+    // with every worker gone, waiting on more to turn up could take forever.
+    // Only connections which have said hello are workers
+    int live = 0;
+    for ( i = 0; i < c.worker_count; i++ )
+    {
+      if ( c.workers[ i ].fd >= 0 && c.workers[ i ].hello ) live++;
+    }
+
+    if ( live > 0 )
+    {
+      lonely_since = now;
+    }
+    else if ( now - lonely_since >= LONELY_SECONDS )
+    {
+      if ( !coordinator_render_rest( &c ) ) break;
+    }
+  }
+
+  // let the workers go
+  int i;
+  for ( i = 0; i < c.worker_count; i++ )
+  {
+    if ( c.workers[ i ].fd < 0 ) continue;
+
+    send_message( c.workers[ i ].fd, MESSAGE_DONE, NULL, 0 );
+    close( c.workers[ i ].fd );
+    free( c.workers[ i ].buffer );
+  }
+
+  bool finished = c.tiles_done == c.tile_count;
+
+  for ( f = 0; f < frame_count; f++ )
+  {
+    if ( c.images[ f ] ) bitmap_delete( c.images[ f ] );
+  }
+
+  free( fds );
+  free( c.workers );
+  free( c.retries );
+  free( c.tiles );
+  free( c.frames_remaining );
+  free( c.images );
+
+  return finished;
+}
+
+/**
+ * Keep the worker holding as many tiles as it can, while there are any left.
+ */
+static void coordinator_assign( coordinator_t* c, worker_t* w )
+{
+  if ( !w->hello ) return;
+
+  while ( w->in_flight < PIPELINE )
+  {
+    int t;
+    if ( c->retry_count > 0 )
+    {
+      t = c->retries[ --c->retry_count ];
+    }
+    else if ( c->next_tile < c->tile_count )
+    {
+      t = c->next_tile++;
+    }
+    else
+    {
+      return;
+    }
+
+    band_t band;
+    coordinator_band( c, t, &band );
+
+    unsigned char payload[ TILE_SIZE ];
+    put_u32( payload, t );
+    put_u32( payload + 4, band.width );
+    put_u32( payload + 8, band.frame_height );
+    put_u32( payload + 12, band.row_start );
+    put_u32( payload + 16, band.rows );
+    put_u32( payload + 20, band.max );
+    put_double( payload + 24, band.x_min );
+    put_double( payload + 32, band.x_max );
+    put_double( payload + 40, band.y_min );
+    put_double( payload + 48, band.y_max );
+
+    w->tiles[ w->in_flight++ ] = t;
+
+    if ( !send_message( w->fd, MESSAGE_TILE, payload, TILE_SIZE ) )
+    {
+      coordinator_drop( c, w );
+      return;
+    }
+  }
+}
+
+/**
+ * Forget a worker, and hand out whatever it was holding again.
+ */
+static void coordinator_drop( coordinator_t* c, worker_t* w )
+{
+  if ( w->fd < 0 ) return;
+
+  int i;
+  for ( i = 0; i < w->in_flight; i++ )
+  {
+    c->retries[ c->retry_count++ ] = w->tiles[ i ];
+  }
+  w->in_flight = 0;
+
+  close( w->fd );
+  w->fd = -1;
+
+  free( w->buffer );
+  w->buffer = NULL;
+  w->used = 0;
+  w->capacity = 0;
+}
+
+/**
+ * Take in whatever the worker has sent, and act on every whole message.
+ * Returns false if the worker is gone or sent something it shouldn't.
+ */
+static bool coordinator_read( coordinator_t* c, worker_t* w )
+{
+  while ( true )
+  {
+    if ( w->capacity - w->used < 65536 )
+    {
+      w->capacity = w->capacity ? w->capacity * 2 : 131072;
+      w->buffer = realloc( w->buffer, w->capacity );
+    }
+
+    ssize_t got = read( w->fd, w->buffer + w->used, w->capacity - w->used );
+    if ( got < 0 && errno == EINTR ) continue;
+    if ( got < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+    if ( got <= 0 ) return false;
+
+    w->used += got;
+  }
+
+  size_t offset = 0;
+  while ( w->used - offset >= HEADER_SIZE )
+  {
+    uint32_t type = get_u32( w->buffer + offset );
+    size_t size = get_u32( w->buffer + offset + 4 );
+    if ( size > MAX_PAYLOAD ) return false;
+    if ( w->used - offset < HEADER_SIZE + size ) break;
+
+    if ( !coordinator_handle( c, w, type, w->buffer + offset + HEADER_SIZE, size ) ) return false;
+
+    offset += HEADER_SIZE + size;
+  }
+
+  memmove( w->buffer, w->buffer + offset, w->used - offset );
+  w->used -= offset;
+
+  return true;
+}
+
+static bool coordinator_handle( coordinator_t* c, worker_t* w, uint32_t type, const unsigned char* payload, size_t size )
+{
+  if ( type == MESSAGE_HELLO )
+  {
+    if ( size != HELLO_SIZE || get_u32( payload ) != FARM_MAGIC || get_u32( payload + 4 ) != FARM_VERSION )
+    {
+      return false;
+    }
+
+    w->hello = true;
+    coordinator_assign( c, w );
+
+    // handing out tiles drops the worker if it can't be written to
+    return w->fd >= 0;
+  }
+
+  // having heard from the worker at all is what keeps it from timing out
+  if ( type == MESSAGE_BUSY ) return w->hello;
+
+  if ( type != MESSAGE_RESULT || size < 8 || !w->hello ) return false;
+
+  // it has to be one of the tiles the worker is holding
+  int t = get_u32( payload );
+  int slot;
+  for ( slot = 0; slot < w->in_flight; slot++ )
+  {
+    if ( w->tiles[ slot ] == t ) break;
+  }
+  if ( slot == w->in_flight ) return false;
+
+  tile_t* tile = c->tiles + t;
+  const farm_frame_t* frame = c->frames + tile->frame;
+
+  int count = frame->width * ( tile->row_end - tile->row_start );
+  if ( ( int ) get_u32( payload + 4 ) != count ) return false;
+
+  int* values = malloc( sizeof( int ) * ( count ? count : 1 ) );
+  if ( !farm_decode( payload + 8, size - 8, values, count ) )
+  {
+    free( values );
+    return false;
+  }
+
+  w->tiles[ slot ] = w->tiles[ --w->in_flight ];
+
+  coordinator_store( c, t, values );
+  free( values );
+
+  coordinator_assign( c, w );
+  return w->fd >= 0;
+}
+
+/**
+ * Describe the rows of its frame tile t covers.
+ */
+static void coordinator_band( coordinator_t* c, int t, band_t* band )
+{
+  const tile_t* tile = c->tiles + t;
+  const farm_frame_t* frame = c->frames + tile->frame;
+
+  band->width = frame->width;
+  band->frame_height = frame->height;
+  band->row_start = tile->row_start;
+  band->rows = tile->row_end - tile->row_start;
+  band->max = frame->max;
+  band->x_min = frame->x_min;
+  band->x_max = frame->x_max;
+  band->y_min = frame->y_min;
+  band->y_max = frame->y_max;
+}
+
+/**
+ * Color tile t's iteration counts into its frame, saving the frame if that
+ * was the last of its tiles.
+ */
+static void coordinator_store( coordinator_t* c, int t, const int* values )
+{
+  const tile_t* tile = c->tiles + t;
+  const farm_frame_t* frame = c->frames + tile->frame;
+
+  bitmap* bm = c->images[ tile->frame ];
+  int i, j;
+  for ( j = tile->row_start; j < tile->row_end; j++ )
+  {
+    const int* row = values + ( j - tile->row_start ) * frame->width;
+
+    for ( i = 0; i < frame->width; i++ )
+    {
+      int iters = row[ i ] < 0 ? 0 : row[ i ] > frame->max ? frame->max : row[ i ];
+      bitmap_set( bm, i, j, iteration_to_color( iters, frame->max ) );
+    }
+  }
+
+  c->tiles_done++;
+  if ( --c->frames_remaining[ tile->frame ] == 0 )
+  {
+    coordinator_save( c, tile->frame );
+  }
+}
+
+/**
+ * With no workers left, render every tile nobody has finished here, if the
+ * options allow it. Returns false if they don't.
+ */
+static bool coordinator_render_rest( coordinator_t* c )
+{
+  int remaining = c->tile_count - c->tiles_done;
+
+  if ( c->options->local_threads < 1 )
+  {
+    fprintf( stderr, "farm: no workers left, giving up on the last %d tiles\n", remaining );
+    return false;
+  }
+
+  fprintf( stderr, "farm: no workers left, rendering the last %d tiles here\n", remaining );
+
+  mandel_renderer* renderer = mandel_renderer_create( c->options->local_threads );
+
+  while ( c->retry_count > 0 || c->next_tile < c->tile_count )
+  {
+    int t = c->retry_count > 0 ? c->retries[ --c->retry_count ] : c->next_tile++;
+
+    band_t band;
+    coordinator_band( c, t, &band );
+
+    mandel_orbits_t* orbits = band_render( renderer, &band, NULL, NULL );
+    coordinator_store( c, t, orbits->iterations );
+    mandel_orbits_delete( orbits );
+  }
+
+  mandel_renderer_delete( renderer );
+
+  return true;
+}
+
+static void coordinator_save( coordinator_t* c, int frame )
+{
+  if ( !bitmap_save( c->images[ frame ], c->frames[ frame ].file_name ) )
+  {
+    fprintf(
+        stderr,
+        "farm: couldn't write to %s: %s\n",
+        c->frames[ frame ].file_name,
+        strerror( errno )
+    );
+  }
+
+  bitmap_delete( c->images[ frame ] );
+  c->images[ frame ] = NULL;
+}
+
+//
+// Worker
+//
+
+/**
+ * Connect to the coordinator, giving it a few seconds to come up.
+ */
+static int worker_connect( const char* host, int port )
+{
+  char service[ 16 ];
+  snprintf( service, sizeof( service ), "%d", port );
+
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof( hints ) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int attempt;
+  for ( attempt = 0; attempt < CONNECT_ATTEMPTS; attempt++ )
+  {
+    struct addrinfo* addresses;
+    if ( getaddrinfo( host, service, &hints, &addresses ) != 0 ) return -1;
+
+    struct addrinfo* address;
+    for ( address = addresses; address; address = address->ai_next )
+    {
+      int fd = socket( address->ai_family, address->ai_socktype, address->ai_protocol );
+      if ( fd < 0 ) continue;
+
+      if ( connect( fd, address->ai_addr, address->ai_addrlen ) == 0 )
+      {
+        freeaddrinfo( addresses );
+        return fd;
+      }
+      close( fd );
+    }
+    freeaddrinfo( addresses );
+
+    struct timespec delay = { 0, CONNECT_DELAY_MS * 1000 * 1000 };
+    nanosleep( &delay, NULL );
+  }
+
+  return -1;
+}
+
+static void worker_busy( void* data )
+{
+  int* fd = data;
+
+  // a coordinator which has gone away shows up when the result is sent
+  send_message( *fd, MESSAGE_BUSY, NULL, 0 );
+}
+
+/**
+ * Render tiles for the coordinator at host:port with thread_count threads,
+ * until it says there are none left. Returns false if the coordinator
+ * couldn't be reached or went away.
+ */
+bool farm_work( const char* host, int port, int thread_count )
+{
+  int fd = worker_connect( host, port );
+  if ( fd < 0 )
+  {
+    fprintf( stderr, "farm: couldn't reach a coordinator at %s:%d\n", host, port );
+    return false;
+  }
+
+  int yes = 1;
+  setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof( yes ) );
+
+  unsigned char hello[ HELLO_SIZE ];
+  put_u32( hello, FARM_MAGIC );
+  put_u32( hello + 4, FARM_VERSION );
+  put_u32( hello + 8, thread_count );
+
+  if ( !send_message( fd, MESSAGE_HELLO, hello, HELLO_SIZE ) )
+  {
+    close( fd );
+    return false;
+  }
+
+  mandel_renderer* renderer = mandel_renderer_create( thread_count );
+
+  bool finished = false;
+  while ( true )
+  {
+    uint32_t type;
+    size_t size;
+    unsigned char* payload = receive_message( fd, &type, &size );
+    if ( !payload ) break;
+
+    if ( type == MESSAGE_DONE )
+    {
+      finished = true;
+      free( payload );
+      break;
+    }
+
+    if ( type != MESSAGE_TILE || size != TILE_SIZE )
+    {
+      free( payload );
+      break;
+    }
+
+    uint32_t tile = get_u32( payload );
+    band_t band = {
+      .width = get_u32( payload + 4 ),
+      .frame_height = get_u32( payload + 8 ),
+      .row_start = get_u32( payload + 12 ),
+      .rows = get_u32( payload + 16 ),
+      .max = get_u32( payload + 20 ),
+      .x_min = get_double( payload + 24 ),
+      .x_max = get_double( payload + 32 ),
+      .y_min = get_double( payload + 40 ),
+      .y_max = get_double( payload + 48 )
+    };
+    free( payload );
+
+    mandel_orbits_t* orbits = band_render( renderer, &band, worker_busy, &fd );
+
+    int count = band.width * band.rows;
+    unsigned char* result = malloc( 8 + farm_encode_bound( count ) );
+    put_u32( result, tile );
+    put_u32( result + 4, count );
+    size_t encoded = farm_encode( orbits->iterations, count, result + 8 );
+
+    bool sent = send_message( fd, MESSAGE_RESULT, result, 8 + encoded );
+
+    free( result );
+    mandel_orbits_delete( orbits );
+
+    if ( !sent ) break;
+  }
+
+  mandel_renderer_delete( renderer );
+  close( fd );
+
+  return finished;
+}
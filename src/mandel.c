@@ -8,52 +8,28 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <stdbool.h>
-#include <coloring.h>
+#include <mandelbrot.h>
+#include <profile.h>
+#include <raw.h>
 #include <time.h>
 
 //
 // Definitions
 //
 
-typedef struct
-{
-  bitmap* bm;
-
-  int width;
-  int height;
-  
-  double x_min;
-  double x_max;
-
-  double y_min;
-  double y_max;
-
-  int max;
-}
-image_params_t;
-
-typedef struct
-{
-  const image_params_t* params;
-
-  int row_start;
-  int row_end;
-}
-work_t;
+// the size of the scenes rendered while auto-tuning
+#define AUTOTUNE_SIZE 384
 
-int work_pool_index = 0;
-work_t* work_pool = NULL;
-pthread_mutex_t m_work_pool = PTHREAD_MUTEX_INITIALIZER;
+// how many times each configuration is timed while auto-tuning
+#define AUTOTUNE_RUNS 2
 
 //
 // Declarations
 //
 
-int iteration_to_color( int i, int max );
-int iterations_at_point( double x, double y, int max );
-void* mandelbrot_compute( void* );
+void autotune();
+int run_session( mandel_view_t* view, const mandel_schedule_t* schedule );
 void show_help();
 int execute( int argc, char* argv[] );
 
@@ -98,7 +74,7 @@ int main( int argc, char* argv[] )
 
 int execute( int argc, char* argv[] )
 {
-  char c;
+  int c;
 
   // These are the default configuration values used
   // if no command line arguments are given.
@@ -109,22 +85,81 @@ int execute( int argc, char* argv[] )
   int image_width = 500;
   int image_height = 500;
   int max = 1000;
-  int thread_count = 1;
-  bool work_stealing = false;
+  bool distance_estimation = false;
+  bool histogram = false;
+  bool snap_to_axis = false;
+  char* raw_file = NULL;
+  int raw_precision = RAW_U32;
+  bool raw_compressed = false;
+  char* orbits_file = NULL;
+  bool restart = false;
+  bool run_autotune = false;
+  bool interactive = false;
+  bool use_profile = true;
+
+  profile_t schedule = {
+    .thread_count = 1,
+    .work_stealing = false,
+    .uniform_rows = false,
+    .tile_rows = 1
+  };
+
+  static const struct option long_options[] = {
+    { "autotune",   no_argument, NULL, 'A' },
+    { "no-profile", no_argument, NULL, 'P' },
+    { "precision",  required_argument, NULL, 'Q' },
+    { "compress",   no_argument, NULL, 'Z' },
+    { "restart",    no_argument, NULL, 'B' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  // The machine's profile (if there is one) replaces the defaults, so it
+  // has to be loaded before any of the command line arguments are looked at
+  int i;
+  for ( i = 1; i < argc; i++ )
+  {
+    if ( strcmp( argv[ i ], "--no-profile" ) == 0 ) use_profile = false;
+  }
+
+  if ( use_profile )
+  {
+    profile_load( &schedule );
+  }
 
   // For each command line argument given,
   // override the appropriate configuration value.
 
-  while( ( c = getopt( argc, argv, "n:x:y:s:W:H:m:o:hw" ) ) != -1 ) 
+  while( ( c = getopt_long( argc, argv, "n:x:y:s:W:H:m:o:t:R:I:hwdeuaS", long_options, NULL ) ) != -1 ) 
   {
     switch( c )
     {
       case 'w':
-        work_stealing = true;
+        schedule.work_stealing = true;
+        break;
+
+      case 'd':
+        distance_estimation = true;
+        break;
+
+      case 'e':
+        histogram = true;
+        break;
+
+      case 'a':
+        snap_to_axis = true;
+        break;
+
+      case 'u':
+        schedule.work_stealing = false;
+        schedule.uniform_rows = true;
+        break;
+
+      case 't':
+        schedule.tile_rows = atoi( optarg );
         break;
 
       case 'n':
-        thread_count = atoi( optarg );
+        schedule.thread_count = atoi( optarg );
         break;
 
       case 'x':
@@ -155,6 +190,39 @@ int execute( int argc, char* argv[] )
         file_name = optarg;
         break;
 
+      case 'R':
+        orbits_file = optarg;
+        break;
+
+      case 'B':
+        restart = true;
+        break;
+
+      case 'A':
+        run_autotune = true;
+        break;
+
+      case 'S':
+        interactive = true;
+        break;
+
+      case 'P':
+        break;
+
+      case 'I':
+        raw_file = optarg;
+        break;
+
+      case 'Q':
+        if ( strcmp( optarg, "16" ) == 0 ) raw_precision = RAW_U16;
+        else if ( strcmp( optarg, "smooth" ) == 0 ) raw_precision = RAW_SMOOTH;
+        else raw_precision = RAW_U32;
+        break;
+
+      case 'Z':
+        raw_compressed = true;
+        break;
+
       case 'h':
         show_help();
         exit( 0 );
@@ -162,82 +230,120 @@ int execute( int argc, char* argv[] )
     }
   }
 
+  if ( run_autotune )
+  {
+    autotune();
+    return 0;
+  }
+
   // Display the configuration of the image.
 #ifndef TIMING
   printf( 
-      "mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s threads=%d %s\n", 
+      "mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s threads=%d%s%s\n", 
       x_center,
       y_center,
       scale,
       max,
       file_name,
-      thread_count,
-      ( work_stealing ? "(work stealing)" : "" )
+      schedule.thread_count,
+      ( schedule.work_stealing ? " (work stealing)" : "" ),
+      ( distance_estimation ? " (distance estimation)" : "" )
   );
 #endif
 
-  // create the generic params struct
-  image_params_t params = {
+  // describe the image for the renderer
+  mandel_view_t view = {
     .x_min = x_center - scale,
     .x_max = x_center + scale,
     .y_min = y_center - scale,
     .y_max = y_center + scale,
     .bm = bitmap_create( image_width, image_height ),
-    .width = image_width,
-    .height = image_height,
-    .max = max
+    .max = max,
+    .distance_estimation = distance_estimation,
+    .histogram = histogram
   };
 
-  // determine the size of our work pool (depends on work stealing)
-  int work_size = thread_count;
-  if ( work_stealing )
+  if ( snap_to_axis )
   {
-    work_size = image_height;
+    mandel_view_snap_to_axis( &view );
   }
 
-  // create the work pool
-  pthread_mutex_init( &m_work_pool, NULL );
-  work_pool = malloc( sizeof( work_t ) * work_size );
-  work_pool_index = work_size - 1; // work from the back to the front
+  if ( interactive && histogram )
+  {
+    fprintf( stderr, "mandel: -e can't be used with -S, using the usual colors\n" );
+  }
 
-  int start_row = 0;
-  int i;
-  for ( i = 0; i < work_size; i++ )
+  if ( interactive )
   {
-    work_pool[ i ].params = &params;
-    work_pool[ i ].row_start = start_row;
+    int status = run_session( &view, &schedule );
+    bitmap_delete( view.bm );
+    return status;
+  }
 
-    start_row += ( image_height / work_size );
-    work_pool[ i ].row_end = start_row;
+  // carry on from a previous render of this view, if there was one
+  if ( orbits_file && distance_estimation )
+  {
+    fprintf( stderr, "mandel: -R can't be used with -d, ignoring it\n" );
+    orbits_file = NULL;
   }
 
-  // make sure the entire image is generated
-  work_pool[ work_size - 1 ].row_end = image_height + 1;
+  if ( raw_file && raw_precision == RAW_U16 && max > 65535 )
+  {
+    fprintf( stderr, "mandel: counts above 65535 won't fit in 16 bits, and will be capped\n" );
+  }
 
-  // create the thread array
-  pthread_t* threads = malloc( sizeof( pthread_t ) * thread_count );
-  
-  // spawn off all of the threads
-  for ( i = 0; i < thread_count; i++ )
+  if ( raw_file && distance_estimation )
   {
-    if ( pthread_create( threads + i, NULL, mandelbrot_compute, NULL ) )
-    {
-      perror( "Error creating thread: " );
-      exit( EXIT_FAILURE );
-    }
+    fprintf( stderr, "mandel: -I can't be used with -d, ignoring it\n" );
+    raw_file = NULL;
   }
 
-  // wait for all threads to finish
-  for ( i = 0; i < thread_count; i++ )
+  if ( orbits_file )
   {
-    if ( pthread_join( threads[ i ], NULL ) )
+    view.orbits = mandel_orbits_load( &view, orbits_file );
+
+#ifndef TIMING
+    if ( view.orbits )
+    {
+      printf( "mandel: resuming from max=%d in %s\n", view.orbits->max, orbits_file );
+    }
+#endif
+
+    // a state file which is there but doesn't fit could have taken hours,
+    // so it's only replaced when asked to
+    if ( !view.orbits && errno != ENOENT && !restart )
     {
-      perror( "Problem with pthread_join: " );
+      fprintf(
+          stderr,
+          "mandel: couldn't resume from %s: %s, so it's left alone; use --restart to replace it\n",
+          orbits_file,
+          errno == EINVAL ? "it was saved for another view or a larger max" : strerror( errno )
+      );
+      orbits_file = NULL;
+    }
+
+    if ( !view.orbits )
+    {
+      view.orbits = mandel_orbits_create( image_width, image_height );
     }
   }
 
+  // the iterations are only kept in the orbit state
+  if ( raw_file && !view.orbits )
+  {
+    view.orbits = mandel_orbits_create( image_width, image_height );
+  }
+
+  mandel_renderer* renderer = mandel_renderer_create( schedule.thread_count );
+
+  mandel_job* job = mandel_render( renderer, &view, &schedule, NULL, NULL );
+  mandel_job_wait( job );
+  mandel_job_delete( job );
+
+  mandel_renderer_delete( renderer );
+
   // write the final image
-  if( !bitmap_save( params.bm, file_name ) ) 
+  if( !bitmap_save( view.bm, file_name ) ) 
   {
     fprintf( 
         stderr, 
@@ -251,97 +357,256 @@ int execute( int argc, char* argv[] )
     return 1;
   }
 
+  if ( raw_file && !raw_save( &view, raw_precision, 0, raw_compressed, raw_file ) )
+  {
+    fprintf( 
+        stderr, 
+        "mandel: couldn't write to %s: %s\n",
+        raw_file,
+        strerror( errno ) 
+    );
+  }
+
+  if ( orbits_file && !mandel_orbits_save( &view, orbits_file ) )
+  {
+    fprintf( 
+        stderr, 
+        "mandel: couldn't write to %s: %s\n",
+        orbits_file,
+        strerror( errno ) 
+    );
+  }
+
+  if ( view.orbits )
+  {
+    mandel_orbits_delete( view.orbits );
+  }
+
+  bitmap_delete( view.bm );
+
   return 0;
 }
 
 /**
- * Compute an entire Mandelbrot image, writing each point to the given bitmap.
- * Scale the image to the range (xmin-xmax,ymin-ymax), limiting iterations to "max"
+ * Explore the set interactively, reading one command per line from stdin:
+ *
+ *   pan <dx> <dy>   move the view by a number of pixels
+ *   in <factor>     zoom in on the center by an integer factor
+ *   out <factor>    zoom out from the center by an integer factor
+ *   save <file>     write the current image to file
+ *   quit            stop
+ *
+ * Only the pixels exposed by each move are rendered.
  */
-void* mandelbrot_compute( void* _ )
+int run_session( mandel_view_t* view, const mandel_schedule_t* schedule )
 {
-  (void)(_);
+  mandel_renderer* renderer = mandel_renderer_create( schedule->thread_count );
+  mandel_session* session = mandel_session_create( renderer, view, schedule );
 
-  const work_t* work = NULL;
-
-  // each thread will stay alive until there's no more work for it to do
-  while ( true ) 
+  char line[ 1024 ];
+  while ( fgets( line, sizeof( line ), stdin ) )
   {
-    // get the next work item from the pool
-    {
+    char command[ 16 ];
+    char argument[ 1000 ];
+    int a = 0, b = 0;
 
-      work = NULL;
+    if ( sscanf( line, "%15s", command ) != 1 ) continue;
+    if ( strcmp( command, "quit" ) == 0 ) break;
 
-      // safely grab the next item from the work pool, then move
-      // the pointer down one
-      pthread_mutex_lock( &m_work_pool ); 
-      if ( work_pool_index >= 0 )
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    int rendered = -1;
+    if ( strcmp( command, "pan" ) == 0 && sscanf( line, "%*s %d %d", &a, &b ) == 2 )
+    {
+      rendered = mandel_session_pan( session, a, b );
+    }
+    else if ( strcmp( command, "in" ) == 0 && sscanf( line, "%*s %d", &a ) == 1 )
+    {
+      rendered = mandel_session_zoom_in( session, a );
+    }
+    else if ( strcmp( command, "out" ) == 0 && sscanf( line, "%*s %d", &a ) == 1 )
+    {
+      rendered = mandel_session_zoom_out( session, a );
+    }
+    else if ( strcmp( command, "save" ) == 0 && sscanf( line, "%*s %999s", argument ) == 1 )
+    {
+      if( !bitmap_save( view->bm, argument ) ) 
       {
-        work = work_pool + work_pool_index;
-        work_pool_index--;
+        fprintf( 
+            stderr, 
+            "mandel: couldn't write to %s: %s\n",
+            argument,
+            strerror( errno ) 
+        );
       }
-      pthread_mutex_unlock( &m_work_pool );
-
-      // the loop ends when we couldn't find any more work
-      if ( work == NULL ) break;
+      continue;
+    }
+    else
+    {
+      fprintf( stderr, "mandel: unknown command: %s", line );
+      continue;
     }
 
-    int i, j;
+    clock_gettime( CLOCK_MONOTONIC, &end );
 
-    const image_params_t* info = work->params;
+    const mandel_view_t* current = mandel_session_view( session );
+    printf( 
+        "mandel: x=%.17g y=%.17g scale=%.17g rendered=%d pixels in %.4lfs\n",
+        ( current->x_min + current->x_max ) / 2,
+        ( current->y_min + current->y_max ) / 2,
+        ( current->x_max - current->x_min ) / 2,
+        rendered,
+        ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9
+    );
+    fflush( stdout );
+  }
 
-    int width = bitmap_width( info->bm );
-    int height = bitmap_height( info->bm );
+  mandel_session_delete( session );
+  mandel_renderer_delete( renderer );
 
-    // For every pixel in the image...
+  return 0;
+}
 
-    for( j = work->row_start; j < work->row_end; j++ )
-    {
+/**
+ * Time every combination of thread count, scheduling mode, and tile size on
+ * a few representative scenes, then save the fastest as this host's profile.
+ */
+void autotune()
+{
+  // a shallow view, a busy view on the edge of the set, and a deep zoom
+  static const double scenes[][ 4 ] = {
+    /* x, y, scale, max */
+    {  -0.5,       0.0,       2.0,      1000 },
+    {  -0.745,     0.1,       0.02,     1000 },
+    {   0.2869325, 0.0142905, 0.000001, 1000 },
+  };
+  const int scene_count = sizeof( scenes ) / sizeof( scenes[ 0 ] );
 
-      for( i = 0; i < width; i++ )
-      {
+  static const int tile_sizes[] = { 1, 2, 4, 8, 16 };
+  const int tile_count = sizeof( tile_sizes ) / sizeof( tile_sizes[ 0 ] );
 
-        // Determine the point in x,y space for that pixel.
-        double x = info->x_min + i * ( info->x_max - info->x_min ) / width;
-        double y = info->y_min + j * ( info->y_max - info->y_min ) / height;
+  long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( cpus < 1 ) cpus = 1;
 
-        // Compute the iterations at that point.
-        int iters = iterations_at_point( x, y, info->max );
+  bitmap* bm = bitmap_create( AUTOTUNE_SIZE, AUTOTUNE_SIZE );
 
-        // Set the pixel in the bitmap.
-        // This seems dangerous (modifying shared data), but it's guaranteed that
-        // we can't trample this memory because this row will only be edited by us
-        bitmap_set( info->bm, i, j, iters );
-      }
-    }
-  }
+  profile_t best;
+  double best_time = -1;
 
-  return NULL;
-}
+  printf( "mandel: auto-tuning for up to %ld threads\n", cpus * 2 );
 
-/**
- * Return the number of iterations at point x, y
- * in the Mandelbrot space, up to a maximum of max.
- */
-int iterations_at_point( double x, double y, int max )
-{
-  double x0 = x;
-  double y0 = y;
+  int thread_count = 1;
+  while ( thread_count <= cpus * 2 )
+  {
+    // the same warm pool is used for every schedule with this many threads
+    mandel_renderer* renderer = mandel_renderer_create( thread_count );
 
-  int iter = 0;
+    // every thread count is tried with both static modes, then with work
+    // stealing at each tile size
+    int mode;
+    for ( mode = -2; mode < tile_count; mode++ )
+    {
+      profile_t candidate = {
+        .thread_count = thread_count,
+        .work_stealing = mode >= 0,
+        .uniform_rows = mode == -1,
+        .tile_rows = mode >= 0 ? tile_sizes[ mode ] : 1
+      };
+
+      // with only one thread, the scheduling mode makes no difference
+      if ( thread_count == 1 && mode != -2 ) continue;
 
-  while( ( x * x + y * y <= 4 ) && iter < max ) {
+      double elapsed = 0;
+
+      int scene;
+      for ( scene = 0; scene < scene_count; scene++ )
+      {
+        mandel_view_t view = {
+          .x_min = scenes[ scene ][ 0 ] - scenes[ scene ][ 2 ],
+          .x_max = scenes[ scene ][ 0 ] + scenes[ scene ][ 2 ],
+          .y_min = scenes[ scene ][ 1 ] - scenes[ scene ][ 2 ],
+          .y_max = scenes[ scene ][ 1 ] + scenes[ scene ][ 2 ],
+          .bm = bm,
+          .max = ( int ) scenes[ scene ][ 3 ],
+          .distance_estimation = false
+        };
+
+        // take the fastest of a few runs to filter out noise
+        double fastest = -1;
+
+        int run;
+        for ( run = 0; run < AUTOTUNE_RUNS; run++ )
+        {
+          struct timespec start, end;
+          clock_gettime( CLOCK_MONOTONIC, &start );
+
+          mandel_job* job = mandel_render( renderer, &view, &candidate, NULL, NULL );
+          mandel_job_wait( job );
+          mandel_job_delete( job );
+
+          clock_gettime( CLOCK_MONOTONIC, &end );
+
+          double seconds =
+            ( end.tv_sec - start.tv_sec ) +
+            ( end.tv_nsec - start.tv_nsec ) / 1e9;
+
+          if ( fastest < 0 || seconds < fastest ) fastest = seconds;
+        }
+
+        elapsed += fastest;
+      }
 
-    double xt = x * x - y * y + x0;
-    double yt = 2 * x * y + y0;
+      printf( 
+          "mandel: threads=%-3d %-14s tile_rows=%-3d %.4lfs\n",
+          thread_count,
+          candidate.work_stealing ? "work stealing" :
+            ( candidate.uniform_rows ? "uniform rows" : "probed rows" ),
+          candidate.tile_rows,
+          elapsed
+      );
+      fflush( stdout );
+
+      if ( best_time < 0 || elapsed < best_time )
+      {
+        best = candidate;
+        best_time = elapsed;
+      }
+    }
 
-    x = xt;
-    y = yt;
+    mandel_renderer_delete( renderer );
 
-    iter++;
+    // go up in powers of 2, but make sure the number of cpus itself is tried
+    if ( thread_count < cpus && thread_count * 2 > cpus )
+    {
+      thread_count = cpus;
+    }
+    else
+    {
+      thread_count *= 2;
+    }
   }
 
-  return iteration_to_color( iter, max );
+  bitmap_delete( bm );
+
+  printf( 
+      "mandel: best is threads=%d %s (tile_rows=%d), saving to %s\n",
+      best.thread_count,
+      best.work_stealing ? "work stealing" :
+        ( best.uniform_rows ? "uniform rows" : "probed rows" ),
+      best.tile_rows,
+      profile_path()
+  );
+
+  if ( !profile_save( &best ) )
+  {
+    fprintf( 
+        stderr, 
+        "mandel: couldn't write to %s: %s\n",
+        profile_path(),
+        strerror( errno ) 
+    );
+  }
 }
 
 void show_help()
@@ -360,6 +625,30 @@ void show_help()
   printf( "-w           Uses a work-stealing algorithm where each thread will grab\n" );
   printf( "             will grab an unprocessed row from a common pool until the\n" );
   printf( "             image has been finished\n" );
+  printf( "-t <rows>    The number of rows in each work item with -w (default=1)\n" );
+  printf( "-u           Splits the rows evenly between threads, rather than by\n" );
+  printf( "             their estimated cost\n" );
+  printf( "-d           Colors the image by estimated distance to the set, and\n" );
+  printf( "             fills in regions far outside the set without iterating\n" );
+  printf( "-e           Spreads the colors evenly over the iteration counts that\n" );
+  printf( "             are actually in the image (histogram equalization)\n" );
+  printf( "-a           Nudges the view by up to a quarter of a pixel so the real\n" );
+  printf( "             axis lines up with the rows, and half can be mirrored\n" );
+  printf( "-R <file>    Resume from the orbit state saved in file by an earlier\n" );
+  printf( "             render of the same view, then save the new state there\n" );
+  printf( "--restart    With -R, replace a state file saved for another view\n" );
+  printf( "-I <file>    Also write the iteration count of every pixel to file, so\n" );
+  printf( "             it can be colored again later with mandelcolor\n" );
+  printf( "--precision <16|32|smooth>\n" );
+  printf( "             How -I stores each count (default=32)\n" );
+  printf( "--compress   Compresses the -I file tile by tile\n" );
+  printf( "-S           Explore interactively, reading commands from stdin:\n" );
+  printf( "             pan <dx> <dy>, in <factor>, out <factor>, save <file>, quit\n" );
+  printf( "             Only newly exposed pixels are rendered, so each step\n" );
+  printf( "             computes both sides of the real axis, and -e isn't used\n" );
+  printf( "--autotune   Time different schedules on this machine and save the\n" );
+  printf( "             fastest as the defaults for later runs\n" );
+  printf( "--no-profile Ignore the defaults saved by --autotune\n" );
   printf( "-h           Show this help text.\n ");
   printf( "\n" );
   printf( "Some examples are:\n" );
@@ -0,0 +1,424 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <bitmap.h>
+#include <mandelbrot.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef struct
+{
+  char* manifest;
+  int thread_count;
+  int tile_rows;
+  int window;
+  bool histogram;
+  bool snap_to_axis;
+}
+options_t;
+
+// one line of the manifest
+typedef struct
+{
+  double x_center;
+  double y_center;
+  double scale;
+  int image_width;
+  int image_height;
+  int max;
+  char* file_name;
+
+  // what the frame is predicted to cost, so the biggest can go first
+  double cost;
+}
+frame_t;
+
+// how many frames are being rendered at once
+typedef struct
+{
+  pthread_mutex_t m_active;
+  pthread_cond_t c_active;
+  int active;
+  int failed;
+}
+batch_t;
+
+// what a finished frame's callback needs
+typedef struct
+{
+  batch_t* batch;
+  frame_t* frame;
+}
+submission_t;
+
+frame_t* read_manifest( const char* path, int* frame_count, int* bad_lines );
+bool render_batch( options_t* options, frame_t* frames, int frame_count );
+void frame_view( options_t* options, frame_t* frame, bitmap* bm, mandel_view_t* view );
+void frame_done( mandel_job* job, void* data );
+int compare_frame_costs( const void* a, const void* b );
+void show_help();
+int execute( int argc, char* argv[] );
+
+//
+// Implementations
+//
+
+int main( int argc, char* argv[] )
+{
+#ifndef TIMING
+  return execute( argc, argv );
+#else
+
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  int status = execute( argc, argv );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  fprintf( stderr, "%lu\n",
+      ( ( end.tv_sec - start.tv_sec ) * 1000 * 1000 * 1000 ) +
+      ( end.tv_nsec - start.tv_nsec )
+  );
+
+  return status;
+#endif
+}
+
+int execute( int argc, char* argv[] )
+{
+  int c;
+
+  // These are the default configuration values used
+  // if no command line arguments are given.
+  options_t options;
+  options.manifest = NULL;
+  options.thread_count = 1;
+  options.tile_rows = 4;
+  options.window = 0;
+  options.histogram = false;
+  options.snap_to_axis = false;
+
+  // For each command line argument given,
+  // override the appropriate configuration value.
+
+  while( ( c = getopt( argc, argv, "n:t:f:hea" ) ) != -1 )
+  {
+    switch( c )
+    {
+      case 'n':
+        options.thread_count = atoi( optarg );
+        break;
+
+      case 't':
+        options.tile_rows = atoi( optarg );
+        break;
+
+      case 'f':
+        options.window = atoi( optarg );
+        break;
+
+      case 'e':
+        options.histogram = true;
+        break;
+
+      case 'a':
+        options.snap_to_axis = true;
+        break;
+
+      case 'h':
+        show_help();
+        return 0;
+    }
+  }
+
+  if ( optind >= argc )
+  {
+    show_help();
+    return 1;
+  }
+  options.manifest = argv[ optind ];
+
+  if ( options.thread_count < 1 ) options.thread_count = 1;
+
+  // enough frames in flight that there are always tiles from several of them
+  // to choose between, without holding thousands of bitmaps at once
+  if ( options.window < 1 ) options.window = options.thread_count * 4;
+
+  int frame_count, bad_lines;
+  frame_t* frames = read_manifest( options.manifest, &frame_count, &bad_lines );
+  if ( !frames ) return 1;
+
+#ifndef TIMING
+  // Display the configuration of the batch.
+  printf(
+      "mandelbatch: manifest=%s frames=%d threads=%d window=%d\n",
+      options.manifest,
+      frame_count,
+      options.thread_count,
+      options.window
+  );
+#endif
+
+  bool rendered = render_batch( &options, frames, frame_count );
+
+  int i;
+  for ( i = 0; i < frame_count; i++ )
+  {
+    free( frames[ i ].file_name );
+  }
+  free( frames );
+
+  // a line that couldn't be read is a frame that wasn't rendered
+  if ( bad_lines > 0 )
+  {
+    fprintf( stderr, "mandelbatch: %d manifest lines couldn't be read, so their frames weren't rendered\n", bad_lines );
+  }
+
+  return rendered && bad_lines == 0 ? 0 : 1;
+}
+
+/**
+ * Read every view in the manifest, one per line as
+ *   x y scale width height max file
+ * skipping blank lines and lines starting with #. Lines which don't parse
+ * are reported, counted in bad_lines, and left out. Returns NULL if the
+ * manifest can't be read.
+ */
+frame_t* read_manifest( const char* path, int* frame_count, int* bad_lines )
+{
+  FILE* file = strcmp( path, "-" ) == 0 ? stdin : fopen( path, "r" );
+  if ( !file )
+  {
+    fprintf( stderr, "mandelbatch: couldn't open %s: %s\n", path, strerror( errno ) );
+    return NULL;
+  }
+
+  int count = 0;
+  int bad = 0;
+  int capacity = 64;
+  frame_t* frames = malloc( sizeof( frame_t ) * capacity );
+
+  char line[ 4096 ];
+  char name[ 4096 ];
+  int line_number = 0;
+  while ( fgets( line, sizeof( line ), file ) )
+  {
+    line_number++;
+
+    char* start = line + strspn( line, " \t" );
+    if ( *start == '#' || *start == '\n' || *start == '\0' ) continue;
+
+    if ( count == capacity )
+    {
+      capacity *= 2;
+      frames = realloc( frames, sizeof( frame_t ) * capacity );
+    }
+
+    frame_t* frame = frames + count;
+    if ( sscanf(
+          start,
+          "%lf %lf %lf %d %d %d %4095s",
+          &frame->x_center,
+          &frame->y_center,
+          &frame->scale,
+          &frame->image_width,
+          &frame->image_height,
+          &frame->max,
+          name ) != 7 ||
+        frame->image_width < 0 || frame->image_height < 0 || frame->max < 1 )
+    {
+      fprintf( stderr, "mandelbatch: %s:%d: expected x y scale width height max file\n", path, line_number );
+      bad++;
+      continue;
+    }
+
+    frame->file_name = strdup( name );
+    count++;
+  }
+
+  if ( file != stdin ) fclose( file );
+
+  *frame_count = count;
+  *bad_lines = bad;
+  return frames;
+}
+
+/**
+ * Render every frame on one pool. Frames are started biggest first, and
+ * every tile of every frame in flight is ranked together, so whichever tile
+ * is predicted to take longest is always the next one to start. Each frame
+ * is saved by the thread that finishes its last tile. Returns false if any
+ * frame couldn't be rendered or saved.
+ */
+bool render_batch( options_t* options, frame_t* frames, int frame_count )
+{
+  int i;
+  for ( i = 0; i < frame_count; i++ )
+  {
+    // predicting only needs the size of the image, not its pixels
+    bitmap* size = bitmap_wrap( frames[ i ].image_width, frames[ i ].image_height, NULL );
+
+    mandel_view_t view;
+    frame_view( options, frames + i, size, &view );
+    frames[ i ].cost = mandel_predict_cost( &view );
+
+    bitmap_delete( size );
+  }
+
+  qsort( frames, frame_count, sizeof( frame_t ), compare_frame_costs );
+
+  batch_t batch;
+  pthread_mutex_init( &batch.m_active, NULL );
+  pthread_cond_init( &batch.c_active, NULL );
+  batch.active = 0;
+  batch.failed = 0;
+
+  mandel_renderer* renderer = mandel_renderer_create( options->thread_count );
+
+  mandel_schedule_t schedule = {
+    .thread_count = options->thread_count,
+    .work_stealing = true,
+    .uniform_rows = false,
+    .tile_rows = options->tile_rows,
+    .longest_first = true
+  };
+
+  submission_t* submissions = malloc( sizeof( submission_t ) * ( frame_count ? frame_count : 1 ) );
+
+  for ( i = 0; i < frame_count; i++ )
+  {
+    // wait for a frame to finish if the window is full
+    pthread_mutex_lock( &batch.m_active );
+    while ( batch.active >= options->window )
+    {
+      pthread_cond_wait( &batch.c_active, &batch.m_active );
+    }
+    batch.active++;
+    pthread_mutex_unlock( &batch.m_active );
+
+    mandel_view_t view;
+    frame_view( options, frames + i, bitmap_create( frames[ i ].image_width, frames[ i ].image_height ), &view );
+
+    submissions[ i ].batch = &batch;
+    submissions[ i ].frame = frames + i;
+    if ( !mandel_render( renderer, &view, &schedule, frame_done, submissions + i ) )
+    {
+      fprintf( stderr, "mandelbatch: couldn't start rendering %s\n", frames[ i ].file_name );
+      bitmap_delete( view.bm );
+
+      pthread_mutex_lock( &batch.m_active );
+      batch.active--;
+      batch.failed++;
+      pthread_mutex_unlock( &batch.m_active );
+    }
+  }
+
+  // wait for the last frames to be saved
+  pthread_mutex_lock( &batch.m_active );
+  while ( batch.active > 0 )
+  {
+    pthread_cond_wait( &batch.c_active, &batch.m_active );
+  }
+  pthread_mutex_unlock( &batch.m_active );
+
+  mandel_renderer_delete( renderer );
+
+  if ( batch.failed > 0 )
+  {
+    fprintf( stderr, "mandelbatch: %d of %d frames couldn't be rendered or saved\n", batch.failed, frame_count );
+  }
+
+  pthread_mutex_destroy( &batch.m_active );
+  pthread_cond_destroy( &batch.c_active );
+  free( submissions );
+
+  return batch.failed == 0;
+}
+
+/**
+ * Describe the frame as a view rendering into bm, the same way mandel would
+ * with the same options.
+ */
+void frame_view( options_t* options, frame_t* frame, bitmap* bm, mandel_view_t* view )
+{
+  mandel_view_t described = {
+    .bm = bm,
+    .x_min = frame->x_center - frame->scale,
+    .x_max = frame->x_center + frame->scale,
+    .y_min = frame->y_center - frame->scale,
+    .y_max = frame->y_center + frame->scale,
+    .max = frame->max,
+    .distance_estimation = false,
+    .histogram = options->histogram
+  };
+  *view = described;
+
+  if ( options->snap_to_axis )
+  {
+    mandel_view_snap_to_axis( view );
+  }
+}
+
+/**
+ * Called from the pool as soon as a frame's last tile is done, to save the
+ * frame and make room for the next one.
+ */
+void frame_done( mandel_job* job, void* data )
+{
+  submission_t* submission = data;
+  bitmap* bm = mandel_job_view( job )->bm;
+
+  bool saved = bitmap_save( bm, submission->frame->file_name );
+  if ( !saved )
+  {
+    fprintf(
+        stderr,
+        "mandelbatch: couldn't write to %s: %s\n",
+        submission->frame->file_name,
+        strerror( errno )
+    );
+  }
+
+  bitmap_delete( bm );
+  mandel_job_delete( job );
+
+  batch_t* batch = submission->batch;
+  pthread_mutex_lock( &batch->m_active );
+  batch->active--;
+  if ( !saved ) batch->failed++;
+  pthread_cond_signal( &batch->c_active );
+  pthread_mutex_unlock( &batch->m_active );
+}
+
+// sorts the most expensive frames first
+int compare_frame_costs( const void* a, const void* b )
+{
+  double cost_a = ( ( const frame_t* ) a )->cost;
+  double cost_b = ( ( const frame_t* ) b )->cost;
+
+  return ( cost_a < cost_b ) - ( cost_a > cost_b );
+}
+
+void show_help()
+{
+  printf( "Use: mandelbatch [options] <manifest>\n" );
+  printf( "Where manifest lists one view per line (or - to read from stdin) as\n" );
+  printf( "  x y scale width height max file\n" );
+  printf( "\n" );
+  printf( "Where options are:\n" );
+  printf( "-n <threads> The number of threads to render with (default=1)\n" );
+  printf( "-t <rows>    The number of rows in each tile (default=4)\n" );
+  printf( "-f <frames>  The most frames to have in flight at once (default=4 per thread)\n" );
+  printf( "-e           Color each frame by histogram equalization\n" );
+  printf( "-a           Nudge frames crossing the real axis so half can be mirrored\n" );
+  printf( "-h           Show this help text.\n" );
+  printf( "\n" );
+  printf( "An example manifest is:\n" );
+  printf( "# x y scale width height max file\n" );
+  printf( "-0.5 0 1.5 800 600 1000 whole.bmp\n" );
+  printf( "0.286932 0.014287 .0005 500 500 5000 deep.bmp\n\n" );
+}
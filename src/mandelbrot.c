@@ -0,0 +1,1414 @@
+#include <mandelbrot.h>
+#include <coloring.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+//
+// Definitions
+//
+
+// marks a pixel which hasn't been written yet in distance estimation mode;
+// every real color has an alpha of 0, so this can never collide with one
+#define UNCOMPUTED -1
+
+// the escape radius used when estimating distance. This is much larger than
+// the usual radius of 2 so that the estimate converges
+#define DE_ESCAPE_RADIUS 256.0
+
+// the probe pass samples one pixel out of every PROBE_STRIDE in each direction
+#define PROBE_STRIDE 8
+
+// mandel_predict_cost() samples this many points in each direction
+#define PREDICT_SAMPLES 32
+
+// how far, as a fraction of a pixel, two rows can be from being each other's
+// reflection in the real axis and still be mirrored
+#define MIRROR_TOLERANCE 1e-6
+
+typedef struct
+{
+  mandel_job* job;
+
+  int row_start;
+  int row_end;
+
+  // the predicted cost of the item, only used with longest_first
+  double cost;
+}
+work_t;
+
+struct mandel_job
+{
+  mandel_view_t view;
+
+  mandel_callback_t callback;
+  void* data;
+
+  // if set, the job runs this on each of its rows instead of rendering
+  mandel_row_t row;
+  void* row_data;
+
+  // the job's work items, which are handed out from next_item onwards
+  work_t* work;
+  int work_size;
+  int next_item;
+
+  // how many work items haven't been finished yet
+  int remaining;
+
+  // the next job in the renderer's queue
+  mandel_job* next;
+
+  pthread_mutex_t m_done;
+  pthread_cond_t c_done;
+  bool done;
+
+  // the renderer the job was submitted to
+  mandel_renderer* renderer;
+
+  // histogram coloring happens in two passes over the work items; the first
+  // stores iteration counts in the bitmap and counts them up in histogram,
+  // then the second turns each count into its entry in colors
+  bool coloring_pass;
+  int* histogram;
+  int* colors;
+
+  // only rows computed_start to computed_end are computed. If mirror_sum
+  // isn't negative, row j is the reflection of row mirror_sum - j in the real
+  // axis, and the other rows are copied from the ones they reflect
+  int computed_start;
+  int computed_end;
+  int mirror_sum;
+
+  // the same, for the whole view when the bitmap only holds some of its
+  // rows. Those rows are all computed, but each one which a render of the
+  // whole view would mirror is computed at its reflection's position
+  int frame_start;
+  int frame_end;
+  int frame_mirror_sum;
+};
+
+struct mandel_renderer
+{
+  pthread_t* threads;
+  int thread_count;
+
+  // every job with work items that haven't been handed out yet, oldest first
+  pthread_mutex_t m_queue;
+  pthread_cond_t c_queue;
+  mandel_job* queue_head;
+  mandel_job* queue_tail;
+  bool stopping;
+
+  // the work items of every longest_first job, kept as a heap with the most
+  // expensive item on top. These are only handed out once the queue is empty
+  work_t** ranked;
+  int ranked_count;
+  int ranked_capacity;
+
+  // extra threads started with the lender's permission
+  bool has_lender;
+  mandel_lender_t lender;
+  pthread_t* borrowed;
+  int borrowed_count;
+  int borrowed_capacity;
+  int borrowed_active;
+};
+
+//
+// Declarations
+//
+
+void* renderer_worker( void* arg );
+void* renderer_borrowed_worker( void* arg );
+work_t* renderer_take_work( mandel_renderer* r );
+bool renderer_has_work( mandel_renderer* r );
+void renderer_rank( mandel_renderer* r, mandel_job* job );
+work_t* renderer_take_ranked( mandel_renderer* r );
+void renderer_borrow_thread( mandel_renderer* r );
+void job_find_mirror( mandel_job* job );
+void job_partition( mandel_job* job, const mandel_schedule_t* schedule );
+void job_finish_work( mandel_job* job );
+void renderer_enqueue( mandel_renderer* r, mandel_job* job );
+void job_run_work( const work_t* work );
+void job_build_colors( mandel_job* job );
+void mandelbrot_compute( const work_t* work );
+void mandelbrot_color( const work_t* work );
+void thread_histogram_release( void );
+void mirror_rows( const work_t* work );
+double* probe_row_costs( const mandel_view_t* view );
+void distance_fill( const work_t* work, int i, int j, double distance );
+int orbit_at_pixel( const mandel_view_t* view, int i, int j, double x, double y );
+
+//
+// Renderer
+//
+
+/**
+ * Create a renderer with a pool of thread_count threads, which wait for jobs
+ * until the renderer is deleted.
+ */
+mandel_renderer* mandel_renderer_create( int thread_count )
+{
+  mandel_renderer* r = calloc( 1, sizeof( *r ) );
+  if ( !r ) return NULL;
+
+  if ( thread_count < 1 ) thread_count = 1;
+
+  pthread_mutex_init( &r->m_queue, NULL );
+  pthread_cond_init( &r->c_queue, NULL );
+
+  r->thread_count = thread_count;
+  r->threads = malloc( sizeof( pthread_t ) * thread_count );
+
+  int i;
+  for ( i = 0; i < thread_count; i++ )
+  {
+    if ( pthread_create( r->threads + i, NULL, renderer_worker, r ) )
+    {
+      perror( "Error creating thread: " );
+      exit( EXIT_FAILURE );
+    }
+  }
+
+  return r;
+}
+
+/**
+ * Finish every job which has been submitted, then stop the renderer's threads
+ * (including any borrowed ones) and free it.
+ */
+void mandel_renderer_delete( mandel_renderer* r )
+{
+  pthread_mutex_lock( &r->m_queue );
+  r->stopping = true;
+  pthread_cond_broadcast( &r->c_queue );
+  pthread_mutex_unlock( &r->m_queue );
+
+  int i;
+  for ( i = 0; i < r->thread_count; i++ )
+  {
+    if ( pthread_join( r->threads[ i ], NULL ) )
+    {
+      perror( "Problem with pthread_join: " );
+    }
+  }
+
+  // borrowed threads can borrow more threads, but only while they're still
+  // running, so once we've caught up with the list there's nobody left
+  int joined = 0;
+  while ( true )
+  {
+    pthread_mutex_lock( &r->m_queue );
+    if ( joined == r->borrowed_count )
+    {
+      pthread_mutex_unlock( &r->m_queue );
+      break;
+    }
+    pthread_t thread = r->borrowed[ joined ];
+    pthread_mutex_unlock( &r->m_queue );
+
+    if ( pthread_join( thread, NULL ) )
+    {
+      perror( "Problem with pthread_join: " );
+    }
+    joined++;
+  }
+
+  pthread_mutex_destroy( &r->m_queue );
+  pthread_cond_destroy( &r->c_queue );
+
+  free( r->ranked );
+  free( r->borrowed );
+  free( r->threads );
+  free( r );
+}
+
+int mandel_renderer_threads( mandel_renderer* r )
+{
+  return r->thread_count;
+}
+
+/**
+ * Allow the renderer to borrow extra threads from the given lender whenever
+ * it has more work queued than its own threads are keeping up with.
+ */
+void mandel_renderer_lend( mandel_renderer* r, const mandel_lender_t* lender )
+{
+  pthread_mutex_lock( &r->m_queue );
+  r->lender = *lender;
+  r->has_lender = true;
+  pthread_mutex_unlock( &r->m_queue );
+}
+
+/**
+ * Queue the given view to be rendered. This returns straight away; the job
+ * can be waited on, or if a callback is given, the callback is run once the
+ * view is finished (in which case the job must not be waited on). For an
+ * empty view the callback runs before this returns, so the caller mustn't
+ * hold anything the callback takes, and mustn't use the returned job.
+ */
+mandel_job* mandel_render(
+    mandel_renderer* r,
+    const mandel_view_t* view,
+    const mandel_schedule_t* schedule,
+    mandel_callback_t callback,
+    void* data )
+{
+  mandel_job* job = calloc( 1, sizeof( *job ) );
+  if ( !job ) return NULL;
+
+  job->view = *view;
+  job->callback = callback;
+  job->data = data;
+  job->renderer = r;
+
+  // histograms only make sense when every pixel is counted from scratch
+  if ( view->distance_estimation || view->known || view->frame_height > 0 )
+  {
+    job->view.histogram = false;
+  }
+
+  // distance estimation fills disks which can run into rows the bitmap
+  // doesn't have
+  if ( view->frame_height > 0 )
+  {
+    job->view.distance_estimation = false;
+  }
+
+  // looked up counts have no orbits behind them
+  if ( view->lookup )
+  {
+    job->view.distance_estimation = false;
+    job->view.orbits = NULL;
+  }
+
+  if ( job->view.histogram )
+  {
+    job->histogram = calloc( view->max + 1, sizeof( int ) );
+    job->colors = malloc( sizeof( int ) * ( view->max + 1 ) );
+  }
+
+  pthread_mutex_init( &job->m_done, NULL );
+  pthread_cond_init( &job->c_done, NULL );
+
+  // distance estimation needs to know which pixels have already been filled
+  if ( job->view.distance_estimation && view->known )
+  {
+    int* pixels = bitmap_data( view->bm );
+    int count = bitmap_width( view->bm ) * bitmap_height( view->bm );
+
+    int i;
+    for ( i = 0; i < count; i++ )
+    {
+      if ( !view->known[ i ] ) pixels[ i ] = UNCOMPUTED;
+    }
+  }
+  else if ( job->view.distance_estimation )
+  {
+    bitmap_reset( view->bm, UNCOMPUTED );
+  }
+
+  job_find_mirror( job );
+  job_partition( job, schedule );
+  job->remaining = job->work_size;
+
+  // there's nothing to render for an empty image
+  if ( job->work_size == 0 )
+  {
+    job->remaining = 1;
+    job_finish_work( job );
+    return job;
+  }
+
+  if ( schedule->longest_first && schedule->work_stealing )
+  {
+    renderer_rank( r, job );
+  }
+  else
+  {
+    renderer_enqueue( r, job );
+  }
+
+  return job;
+}
+
+/**
+ * Queue row( data, j ) to be run for every j from 0 to rows on the pool,
+ * with threads taking one row at a time. The job can be waited on, and has
+ * no view.
+ */
+mandel_job* mandel_render_rows( mandel_renderer* r, int rows, mandel_row_t row, void* data )
+{
+  mandel_job* job = calloc( 1, sizeof( *job ) );
+  if ( !job ) return NULL;
+
+  job->row = row;
+  job->row_data = data;
+  job->renderer = r;
+
+  pthread_mutex_init( &job->m_done, NULL );
+  pthread_cond_init( &job->c_done, NULL );
+
+  job->computed_start = 0;
+  job->computed_end = rows < 0 ? 0 : rows;
+  job->mirror_sum = -1;
+  job->frame_mirror_sum = -1;
+
+  mandel_schedule_t schedule = {
+    .thread_count = r->thread_count,
+    .work_stealing = true,
+    .tile_rows = 1
+  };
+  job_partition( job, &schedule );
+  job->remaining = job->work_size;
+
+  if ( job->work_size == 0 )
+  {
+    job->remaining = 1;
+    job_finish_work( job );
+    return job;
+  }
+
+  renderer_enqueue( r, job );
+
+  return job;
+}
+
+/**
+ * Whether there's anything for a thread to take. Must hold m_queue.
+ */
+bool renderer_has_work( mandel_renderer* r )
+{
+  return r->queue_head || r->ranked_count > 0;
+}
+
+/**
+ * Add every one of the job's work items to the heap of ranked items, so
+ * they're handed out most expensive first alongside every other ranked job's.
+ */
+void renderer_rank( mandel_renderer* r, mandel_job* job )
+{
+  pthread_mutex_lock( &r->m_queue );
+
+  if ( r->ranked_count + job->work_size > r->ranked_capacity )
+  {
+    while ( r->ranked_count + job->work_size > r->ranked_capacity )
+    {
+      r->ranked_capacity = r->ranked_capacity ? r->ranked_capacity * 2 : 64;
+    }
+    r->ranked = realloc( r->ranked, sizeof( work_t* ) * r->ranked_capacity );
+  }
+
+  int i;
+  for ( i = 0; i < job->work_size; i++ )
+  {
+    // sift the new item up past anything cheaper
+    int child = r->ranked_count++;
+    while ( child > 0 )
+    {
+      int parent = ( child - 1 ) / 2;
+      if ( r->ranked[ parent ]->cost >= job->work[ i ].cost ) break;
+
+      r->ranked[ child ] = r->ranked[ parent ];
+      child = parent;
+    }
+    r->ranked[ child ] = job->work + i;
+  }
+
+  job->next_item = job->work_size;
+
+  pthread_cond_broadcast( &r->c_queue );
+  pthread_mutex_unlock( &r->m_queue );
+}
+
+/**
+ * Take the most expensive ranked work item, or NULL if there are none. Must
+ * hold m_queue.
+ */
+work_t* renderer_take_ranked( mandel_renderer* r )
+{
+  if ( r->ranked_count == 0 ) return NULL;
+
+  work_t* top = r->ranked[ 0 ];
+  work_t* last = r->ranked[ --r->ranked_count ];
+
+  // sift the last item down from the top past anything more expensive
+  int parent = 0;
+  while ( true )
+  {
+    int child = parent * 2 + 1;
+    if ( child >= r->ranked_count ) break;
+
+    if ( child + 1 < r->ranked_count && r->ranked[ child + 1 ]->cost > r->ranked[ child ]->cost )
+    {
+      child++;
+    }
+    if ( last->cost >= r->ranked[ child ]->cost ) break;
+
+    r->ranked[ parent ] = r->ranked[ child ];
+    parent = child;
+  }
+  r->ranked[ parent ] = last;
+
+  return top;
+}
+
+/**
+ * Hand all of the job's work items (from next_item onwards) to the pool.
+ */
+void renderer_enqueue( mandel_renderer* r, mandel_job* job )
+{
+  pthread_mutex_lock( &r->m_queue );
+  job->next = NULL;
+  if ( r->queue_tail )
+  {
+    r->queue_tail->next = job;
+  }
+  else
+  {
+    r->queue_head = job;
+  }
+  r->queue_tail = job;
+  pthread_cond_broadcast( &r->c_queue );
+  pthread_mutex_unlock( &r->m_queue );
+}
+
+/**
+ * A thread belonging to the renderer, which keeps taking work items until
+ * the renderer is deleted and there's no work left.
+ */
+void* renderer_worker( void* arg )
+{
+  mandel_renderer* r = arg;
+
+  while ( true )
+  {
+    pthread_mutex_lock( &r->m_queue );
+    while ( !renderer_has_work( r ) && !r->stopping )
+    {
+      pthread_cond_wait( &r->c_queue, &r->m_queue );
+    }
+
+    // the loop ends when we're stopping and couldn't find any more work
+    work_t* work = renderer_take_work( r );
+    if ( work == NULL )
+    {
+      pthread_mutex_unlock( &r->m_queue );
+      break;
+    }
+
+    renderer_borrow_thread( r );
+    pthread_mutex_unlock( &r->m_queue );
+
+    job_run_work( work );
+    job_finish_work( work->job );
+  }
+
+  thread_histogram_release();
+
+  return NULL;
+}
+
+/**
+ * A thread borrowed from the lender, which only stays around as long as
+ * there's work queued, and then hands itself back.
+ */
+void* renderer_borrowed_worker( void* arg )
+{
+  mandel_renderer* r = arg;
+
+  while ( true )
+  {
+    pthread_mutex_lock( &r->m_queue );
+    work_t* work = renderer_take_work( r );
+    if ( work == NULL )
+    {
+      r->borrowed_active--;
+      pthread_mutex_unlock( &r->m_queue );
+      break;
+    }
+
+    renderer_borrow_thread( r );
+    pthread_mutex_unlock( &r->m_queue );
+
+    job_run_work( work );
+    job_finish_work( work->job );
+  }
+
+  thread_histogram_release();
+  r->lender.release( r->lender.data );
+
+  return NULL;
+}
+
+/**
+ * Take the next work item from the oldest job in the queue, or NULL if the
+ * queue is empty. Must be called with m_queue held.
+ */
+work_t* renderer_take_work( mandel_renderer* r )
+{
+  mandel_job* job = r->queue_head;
+  if ( job == NULL ) return renderer_take_ranked( r );
+
+  work_t* work = job->work + job->next_item;
+  job->next_item++;
+
+  // every item of this job has been handed out, so it leaves the queue
+  if ( job->next_item == job->work_size )
+  {
+    r->queue_head = job->next;
+    if ( r->queue_head == NULL ) r->queue_tail = NULL;
+  }
+
+  return work;
+}
+
+/**
+ * If work is still queued, try to start one more thread from the lender.
+ * Must be called with m_queue held.
+ */
+void renderer_borrow_thread( mandel_renderer* r )
+{
+  if ( !r->has_lender || !renderer_has_work( r ) ) return;
+  if ( r->borrowed_active >= r->lender.max ) return;
+  if ( !r->lender.borrow( r->lender.data ) ) return;
+
+  if ( r->borrowed_count == r->borrowed_capacity )
+  {
+    r->borrowed_capacity = r->borrowed_capacity ? r->borrowed_capacity * 2 : 8;
+    r->borrowed = realloc( r->borrowed, sizeof( pthread_t ) * r->borrowed_capacity );
+  }
+
+  if ( pthread_create( r->borrowed + r->borrowed_count, NULL, renderer_borrowed_worker, r ) )
+  {
+    // couldn't use it, so let someone else have it
+    r->lender.release( r->lender.data );
+    return;
+  }
+
+  r->borrowed_count++;
+  r->borrowed_active++;
+}
+
+//
+// Jobs
+//
+
+/**
+ * Block until the job's view has been rendered.
+ */
+void mandel_job_wait( mandel_job* job )
+{
+  pthread_mutex_lock( &job->m_done );
+  while ( !job->done )
+  {
+    pthread_cond_wait( &job->c_done, &job->m_done );
+  }
+  pthread_mutex_unlock( &job->m_done );
+}
+
+/**
+ * Check whether the job's view has been rendered, without blocking.
+ */
+bool mandel_job_done( mandel_job* job )
+{
+  pthread_mutex_lock( &job->m_done );
+  bool done = job->done;
+  pthread_mutex_unlock( &job->m_done );
+
+  return done;
+}
+
+const mandel_view_t* mandel_job_view( mandel_job* job )
+{
+  return &job->view;
+}
+
+void mandel_job_delete( mandel_job* job )
+{
+  pthread_mutex_destroy( &job->m_done );
+  pthread_cond_destroy( &job->c_done );
+
+  free( job->histogram );
+  free( job->colors );
+  free( job->work );
+  free( job );
+}
+
+/**
+ * If the view straddles the real axis and its rows line up with their
+ * reflections, only compute the side with more rows and mirror the rest.
+ * When the bitmap only holds some of the view's rows, every one of them is
+ * computed, but the rows which would be mirrored take their values from
+ * their reflections' positions, so they match a render of the whole view.
+ */
+void job_find_mirror( mandel_job* job )
+{
+  const mandel_view_t* view = &job->view;
+
+  int height = bitmap_height( view->bm );
+  int frame_height = view->frame_height > 0 ? view->frame_height : height;
+
+  job->computed_start = 0;
+  job->computed_end = height;
+  job->mirror_sum = -1;
+  job->frame_start = 0;
+  job->frame_end = frame_height;
+  job->frame_mirror_sum = -1;
+
+  // known pixels are carried over from another view, and needn't be
+  // symmetric, so the reflection of a known row may still need computing
+  if ( view->known ) return;
+  if ( height == 0 || view->y_min >= 0 || view->y_max <= 0 ) return;
+
+  // row j is at y_min + j * pixel, so rows j and k reflect each other when
+  // j + k is the position of the axis counted in half rows
+  double pixel = ( view->y_max - view->y_min ) / frame_height;
+  double sum = -2 * view->y_min / pixel;
+  long mirror_sum = lround( sum );
+
+  if ( fabs( sum - mirror_sum ) > MIRROR_TOLERANCE ) return;
+
+  job->frame_mirror_sum = mirror_sum;
+
+  // keep the rows from the edge furthest from the axis up to the axis
+  if ( mirror_sum >= frame_height - 1 )
+  {
+    job->frame_end = mirror_sum / 2 + 1;
+  }
+  else
+  {
+    job->frame_start = ( mirror_sum + 1 ) / 2;
+  }
+
+  if ( view->frame_height > 0 ) return;
+
+  job->computed_start = job->frame_start;
+  job->computed_end = job->frame_end;
+  job->mirror_sum = job->frame_mirror_sum;
+}
+
+/**
+ * Estimate how many iterations rendering the view will take, from a fixed
+ * grid of PREDICT_SAMPLES by PREDICT_SAMPLES points. This is cheap enough to
+ * rank thousands of views before any of them are rendered.
+ */
+double mandel_predict_cost( const mandel_view_t* view )
+{
+  int width = bitmap_width( view->bm );
+  int height = bitmap_height( view->bm );
+
+  double total = 0;
+  int i, j;
+  for ( j = 0; j < PREDICT_SAMPLES; j++ )
+  {
+    double y = view->y_min + ( j + 0.5 ) * ( view->y_max - view->y_min ) / PREDICT_SAMPLES;
+
+    for ( i = 0; i < PREDICT_SAMPLES; i++ )
+    {
+      double x = view->x_min + ( i + 0.5 ) * ( view->x_max - view->x_min ) / PREDICT_SAMPLES;
+
+      // every pixel costs at least one iteration's worth of work to visit
+      total += mandel_escape_iterations( x, y, view->max ) + 1;
+    }
+  }
+
+  return total * width * height / ( PREDICT_SAMPLES * PREDICT_SAMPLES );
+}
+
+/**
+ * Move the view up or down by at most a quarter of a pixel, so the real axis
+ * lands exactly on a row or exactly between two, and the view can be
+ * mirrored. Views which don't cross the axis are left alone.
+ */
+void mandel_view_snap_to_axis( mandel_view_t* view )
+{
+  int height = bitmap_height( view->bm );
+  if ( height == 0 || view->y_min >= 0 || view->y_max <= 0 ) return;
+
+  double pixel = ( view->y_max - view->y_min ) / height;
+  double sum = -2 * view->y_min / pixel;
+  double shift = ( sum - round( sum ) ) * pixel / 2;
+
+  view->y_min += shift;
+  view->y_max += shift;
+}
+
+/**
+ * Split the rows the job computes into work items according to the schedule.
+ */
+void job_partition( mandel_job* job, const mandel_schedule_t* schedule )
+{
+  const mandel_view_t* view = &job->view;
+
+  int first_row = job->computed_start;
+  int image_height = job->computed_end - job->computed_start;
+  int thread_count = schedule->thread_count < 1 ? 1 : schedule->thread_count;
+
+  // determine the size of our work pool (depends on work stealing)
+  int work_size = thread_count;
+  int tile_rows = image_height / thread_count;
+  if ( schedule->work_stealing )
+  {
+    tile_rows = schedule->tile_rows < 1 ? 1 : schedule->tile_rows;
+    work_size = ( image_height + tile_rows - 1 ) / tile_rows;
+  }
+
+  job->work = malloc( sizeof( work_t ) * ( work_size ? work_size : 1 ) );
+  job->work_size = work_size;
+
+  if ( work_size == 0 ) return;
+
+  int i;
+  for ( i = 0; i < work_size; i++ )
+  {
+    job->work[ i ].job = job;
+    job->work[ i ].cost = 0;
+  }
+
+  if ( schedule->work_stealing || schedule->uniform_rows || thread_count == 1 )
+  {
+    int start_row = 0;
+    for ( i = 0; i < work_size; i++ )
+    {
+      job->work[ i ].row_start = first_row + start_row;
+
+      start_row += tile_rows;
+      job->work[ i ].row_end = first_row + ( start_row < image_height ? start_row : image_height );
+    }
+
+    // make sure the entire image is generated
+    job->work[ work_size - 1 ].row_end = first_row + image_height;
+
+    // ranked tiles need to know what they're predicted to cost
+    if ( schedule->work_stealing && schedule->longest_first )
+    {
+      double* costs = probe_row_costs( view );
+
+      for ( i = 0; i < work_size; i++ )
+      {
+        int j;
+        for ( j = job->work[ i ].row_start; j < job->work[ i ].row_end; j++ )
+        {
+          job->work[ i ].cost += costs[ j ];
+        }
+      }
+
+      free( costs );
+    }
+    return;
+  }
+
+  // give each band an equal share of the estimated work instead
+  double* all_costs = probe_row_costs( view );
+  double* costs = all_costs + first_row;
+
+  double total = 0;
+  int j;
+  for ( j = 0; j < image_height; j++ )
+  {
+    total += costs[ j ];
+  }
+
+  double running = 0;
+  int row = 0;
+  for ( i = 0; i < thread_count; i++ )
+  {
+    job->work[ i ].row_start = first_row + row;
+
+    // keep taking rows until this band has reached its share of the total
+    double target = total * ( i + 1 ) / thread_count;
+    while ( row < image_height && running + costs[ row ] / 2 <= target )
+    {
+      running += costs[ row ];
+      row++;
+    }
+
+    job->work[ i ].row_end = first_row + row;
+  }
+
+  // make sure the entire image is generated
+  job->work[ thread_count - 1 ].row_end = first_row + image_height;
+
+  free( all_costs );
+}
+
+/**
+ * Mark one of the job's work items as finished, completing the job if it
+ * was the last one.
+ */
+void job_finish_work( mandel_job* job )
+{
+  if ( __atomic_sub_fetch( &job->remaining, 1, __ATOMIC_ACQ_REL ) > 0 ) return;
+
+  // every count is in, so go round the work items again to color them,
+  // unless there are none, as with an empty image
+  if ( job->view.histogram && !job->coloring_pass && job->work_size > 0 )
+  {
+    job_build_colors( job );
+
+    job->coloring_pass = true;
+    job->next_item = 0;
+    job->remaining = job->work_size;
+
+    renderer_enqueue( job->renderer, job );
+    return;
+  }
+
+  // every pixel's state is now up to date with the new max
+  if ( job->view.orbits )
+  {
+    job->view.orbits->max = job->view.max;
+  }
+
+  // the callback owns the job from here on, so we can't touch it afterwards
+  if ( job->callback )
+  {
+    job->callback( job, job->data );
+    return;
+  }
+
+  pthread_mutex_lock( &job->m_done );
+  job->done = true;
+  pthread_cond_broadcast( &job->c_done );
+  pthread_mutex_unlock( &job->m_done );
+}
+
+/**
+ * Turn the job's finished histogram into a color for every iteration count,
+ * by how many escaped pixels took fewer iterations than that.
+ */
+void job_build_colors( mandel_job* job )
+{
+  int max = job->view.max;
+
+  double escaped = 0;
+  int k;
+  for ( k = 0; k < max; k++ )
+  {
+    escaped += job->histogram[ k ];
+  }
+  if ( escaped == 0 ) escaped = 1;
+
+  // count each bin as being halfway through itself, so the colors are
+  // centered on the pixels they're used for
+  double running = 0;
+  for ( k = 0; k < max; k++ )
+  {
+    job->colors[ k ] = histogram_to_color( ( running + job->histogram[ k ] / 2.0 ) / escaped );
+    running += job->histogram[ k ];
+  }
+
+  // points inside the set are the same as with the usual coloring
+  job->colors[ max ] = iteration_to_color( max, max );
+}
+
+/**
+ * Do whatever the job's current pass needs doing for one work item.
+ */
+void job_run_work( const work_t* work )
+{
+  mandel_job* job = work->job;
+
+  if ( job->row )
+  {
+    int j;
+    for ( j = work->row_start; j < work->row_end; j++ )
+    {
+      job->row( job->row_data, j );
+    }
+    return;
+  }
+
+  if ( job->coloring_pass )
+  {
+    mandelbrot_color( work );
+  }
+  else
+  {
+    mandelbrot_compute( work );
+  }
+
+  // with histograms, the reflections are only copied once they're colored
+  if ( job->mirror_sum >= 0 && ( !job->view.histogram || job->coloring_pass ) )
+  {
+    mirror_rows( work );
+  }
+}
+
+//
+// Kernels
+//
+
+// the imaginary part of the points in row j of the job's bitmap
+static inline double row_y( const mandel_job* job, int j )
+{
+  const mandel_view_t* view = &job->view;
+
+  int row = view->first_row + j;
+  int frame_height = view->frame_height > 0 ? view->frame_height : bitmap_height( view->bm );
+
+  // a row a render of the whole view would copy from its reflection
+  if ( job->frame_mirror_sum >= 0 && ( row < job->frame_start || row >= job->frame_end ) )
+  {
+    row = job->frame_mirror_sum - row;
+  }
+
+  return view->y_min + row * ( view->y_max - view->y_min ) / frame_height;
+}
+
+// the count at x, y, looked up if the view has somewhere to look it up
+static inline int view_iterations( const mandel_view_t* view, double x, double y )
+{
+  if ( view->lookup ) return view->lookup( view->lookup_data, x, y, view->max );
+
+  return mandel_escape_iterations( x, y, view->max );
+}
+
+// whether computed row j has a reflection which is copied from it
+static inline bool row_is_mirrored( const mandel_job* job, int j, int height )
+{
+  int reflection = job->mirror_sum - j;
+
+  return job->mirror_sum >= 0 &&
+    reflection >= 0 && reflection < height &&
+    ( reflection < job->computed_start || reflection >= job->computed_end );
+}
+
+// every pool thread keeps its own histogram, which is always left zeroed
+// between work items so that only the counts a work item touched need merging
+static __thread int* thread_histogram = NULL;
+static __thread int thread_histogram_size = 0;
+
+/**
+ * Free the calling thread's histogram, once it has no more work to take.
+ */
+void thread_histogram_release( void )
+{
+  free( thread_histogram );
+  thread_histogram = NULL;
+  thread_histogram_size = 0;
+}
+
+/**
+ * Compute one work item's rows of a Mandelbrot image, writing each point to
+ * the view's bitmap.
+ */
+void mandelbrot_compute( const work_t* work )
+{
+  int i, j;
+
+  const mandel_view_t* info = &work->job->view;
+
+  int width = bitmap_width( info->bm );
+  int height = bitmap_height( info->bm );
+
+  // the range of counts this work item has put into the thread's histogram
+  int lowest = info->max;
+  int highest = 0;
+
+  if ( info->histogram && thread_histogram_size < info->max + 1 )
+  {
+    free( thread_histogram );
+    thread_histogram = calloc( info->max + 1, sizeof( int ) );
+    thread_histogram_size = info->max + 1;
+  }
+
+  // For every pixel in the image...
+
+  for( j = work->row_start; j < work->row_end; j++ )
+  {
+    double y = row_y( work->job, j );
+
+    for( i = 0; i < width; i++ )
+    {
+
+      // this pixel was carried over from an earlier render
+      if ( info->known && info->known[ j * width + i ] ) continue;
+
+      // Determine the point in x,y space for that pixel.
+      double x = info->x_min + i * ( info->x_max - info->x_min ) / width;
+
+      if ( info->orbits || info->histogram )
+      {
+        int iters = info->orbits ?
+          orbit_at_pixel( info, i, j, x, y ) :
+          view_iterations( info, x, y );
+
+        // leave the count for the coloring pass, counting it for the
+        // mirrored pixel too if there is one
+        if ( info->histogram )
+        {
+          thread_histogram[ iters ] += row_is_mirrored( work->job, j, height ) ? 2 : 1;
+          if ( iters < lowest ) lowest = iters;
+          if ( iters > highest ) highest = iters;
+
+          bitmap_set( info->bm, i, j, iters );
+          continue;
+        }
+
+        bitmap_set( info->bm, i, j, iteration_to_color( iters, info->max ) );
+        continue;
+      }
+
+      if ( info->distance_estimation )
+      {
+        // this pixel was already covered by a neighbor's disk
+        if ( bitmap_get( info->bm, i, j ) != UNCOMPUTED ) continue;
+
+        double distance = mandel_distance_estimate( x, y, info->max );
+        distance_fill( work, i, j, distance );
+        continue;
+      }
+
+      // Compute the iterations at that point.
+      int iters = view_iterations( info, x, y );
+
+      // Set the pixel in the bitmap.
+      // This seems dangerous (modifying shared data), but it's guaranteed that
+      // we can't trample this memory because this row will only be edited by us
+      bitmap_set( info->bm, i, j, iteration_to_color( iters, info->max ) );
+    }
+  }
+
+  if ( !info->histogram ) return;
+
+  // merge this work item's counts into the job's histogram
+  int k;
+  for ( k = lowest; k <= highest; k++ )
+  {
+    if ( thread_histogram[ k ] == 0 ) continue;
+
+    __atomic_add_fetch( work->job->histogram + k, thread_histogram[ k ], __ATOMIC_RELAXED );
+    thread_histogram[ k ] = 0;
+  }
+}
+
+/**
+ * Copy each of the work item's rows over its reflection in the real axis,
+ * where that reflection is in the image but not computed itself. With orbit
+ * state, the reflection's state is copied too, with each z conjugated.
+ */
+void mirror_rows( const work_t* work )
+{
+  const mandel_job* job = work->job;
+
+  int width = bitmap_width( job->view.bm );
+  int height = bitmap_height( job->view.bm );
+  int* pixels = bitmap_data( job->view.bm );
+
+  int j;
+  for ( j = work->row_start; j < work->row_end; j++ )
+  {
+    if ( !row_is_mirrored( job, j, height ) ) continue;
+
+    int reflection = job->mirror_sum - j;
+
+    memcpy(
+        pixels + reflection * width,
+        pixels + j * width,
+        sizeof( int ) * width );
+
+    mandel_orbits_t* orbits = job->view.orbits;
+    if ( !orbits ) continue;
+
+    memcpy(
+        orbits->iterations + ( size_t ) reflection * width,
+        orbits->iterations + ( size_t ) j * width,
+        sizeof( int ) * width );
+
+    const double* z = orbits->z + ( size_t ) j * width * 2;
+    double* mirrored = orbits->z + ( size_t ) reflection * width * 2;
+
+    int i;
+    for ( i = 0; i < width; i++ )
+    {
+      mirrored[ i * 2 ] = z[ i * 2 ];
+      mirrored[ i * 2 + 1 ] = -z[ i * 2 + 1 ];
+    }
+  }
+}
+
+/**
+ * Replace the iteration counts in one work item's rows with their colors.
+ */
+void mandelbrot_color( const work_t* work )
+{
+  const mandel_view_t* info = &work->job->view;
+  const int* colors = work->job->colors;
+
+  int width = bitmap_width( info->bm );
+  int* pixels = bitmap_data( info->bm );
+
+  int i, j;
+  for ( j = work->row_start; j < work->row_end; j++ )
+  {
+    int* row = pixels + j * width;
+
+    for ( i = 0; i < width; i++ )
+    {
+      row[ i ] = colors[ row[ i ] ];
+    }
+  }
+}
+
+/**
+ * Estimate how many iterations each row of the image will take by computing
+ * a low resolution copy of it. The returned array has one entry per row and
+ * must be freed by the caller.
+ */
+double* probe_row_costs( const mandel_view_t* view )
+{
+  int width = bitmap_width( view->bm );
+  int height = bitmap_height( view->bm );
+
+  int frame_height = view->frame_height > 0 ? view->frame_height : height;
+
+  double* costs = calloc( height, sizeof( double ) );
+
+  int i, j, k;
+  for ( j = 0; j < height; j += PROBE_STRIDE )
+  {
+    double y = view->y_min + ( view->first_row + j ) * ( view->y_max - view->y_min ) / frame_height;
+
+    double cost = 0;
+    for ( i = PROBE_STRIDE / 2; i < width; i += PROBE_STRIDE )
+    {
+      // pixels which are already known don't cost anything
+      if ( view->known && view->known[ j * width + i ] ) continue;
+
+      double x = view->x_min + i * ( view->x_max - view->x_min ) / width;
+
+      // every pixel costs at least one iteration's worth of work to visit
+      cost += mandel_escape_iterations( x, y, view->max ) + 1;
+    }
+
+    // every row in this stripe is assumed to cost about the same
+    for ( k = j; k < j + PROBE_STRIDE && k < height; k++ )
+    {
+      costs[ k ] = cost;
+    }
+  }
+
+  return costs;
+}
+
+/**
+ * Return the raw number of iterations it takes for point x, y to escape,
+ * up to a maximum of max.
+ */
+int mandel_escape_iterations( double x, double y, int max )
+{
+  double x0 = x;
+  double y0 = y;
+
+  int iter = 0;
+
+  while( ( x * x + y * y <= 4 ) && iter < max ) {
+
+    double xt = x * x - y * y + x0;
+    double yt = 2 * x * y + y0;
+
+    x = xt;
+    y = yt;
+
+    iter++;
+  }
+
+  return iter;
+}
+
+/**
+ * Carry on the orbit of point cx, cy from its state after iter iterations,
+ * where z is currently zx, zy, up to a maximum of max. The final z is written
+ * back, and the total number of iterations is returned.
+ */
+int mandel_continue_orbit( double cx, double cy, double* zx, double* zy, int iter, int max )
+{
+  double x = *zx;
+  double y = *zy;
+
+  while( ( x * x + y * y <= 4 ) && iter < max ) {
+
+    double xt = x * x - y * y + cx;
+    double yt = 2 * x * y + cy;
+
+    x = xt;
+    y = yt;
+
+    iter++;
+  }
+
+  *zx = x;
+  *zy = y;
+
+  return iter;
+}
+
+/**
+ * Return the number of iterations for pixel i, j (at point x, y) of a view
+ * with orbit state, resuming from the saved state if there is some, and then
+ * saving the new state.
+ */
+int orbit_at_pixel( const mandel_view_t* view, int i, int j, double x, double y )
+{
+  mandel_orbits_t* orbits = view->orbits;
+
+  int index = j * orbits->width + i;
+  double* z = orbits->z + index * 2;
+
+  // the orbit starts at z = c, which counts as no iterations
+  if ( orbits->max == 0 )
+  {
+    z[ 0 ] = x;
+    z[ 1 ] = y;
+    orbits->iterations[ index ] = 0;
+  }
+  // this point already escaped, so there's nothing more to do
+  else if ( orbits->iterations[ index ] < orbits->max )
+  {
+    return orbits->iterations[ index ];
+  }
+
+  int iters = mandel_continue_orbit( x, y, z, z + 1, orbits->iterations[ index ], view->max );
+  orbits->iterations[ index ] = iters;
+
+  return iters;
+}
+
+/**
+ * Allocate orbit state for a width x height view which hasn't been rendered.
+ */
+mandel_orbits_t* mandel_orbits_create( int width, int height )
+{
+  mandel_orbits_t* orbits = malloc( sizeof( *orbits ) );
+  if ( !orbits ) return NULL;
+
+  orbits->width = width;
+  orbits->height = height;
+  orbits->max = 0;
+  orbits->mapping = NULL;
+  orbits->mapping_size = 0;
+  orbits->iterations = calloc( ( size_t ) width * height, sizeof( int ) );
+  orbits->z = calloc( ( size_t ) width * height * 2, sizeof( double ) );
+
+  if ( !orbits->iterations || !orbits->z )
+  {
+    mandel_orbits_delete( orbits );
+    return NULL;
+  }
+
+  return orbits;
+}
+
+void mandel_orbits_delete( mandel_orbits_t* orbits )
+{
+  if ( orbits->mapping )
+  {
+    munmap( orbits->mapping, orbits->mapping_size );
+  }
+  else
+  {
+    free( orbits->iterations );
+    free( orbits->z );
+  }
+  free( orbits );
+}
+
+/**
+ * Return an estimate of the distance from point x, y to the Mandelbrot set,
+ * or -1 if the point didn't escape within max iterations.
+ *
+ * The derivative dz/dc is tracked alongside the orbit, and the estimate is
+ * 2|z|log|z| / |dz/dc|. The true distance is at least a quarter of this.
+ */
+double mandel_distance_estimate( double x, double y, int max )
+{
+  double x0 = x;
+  double y0 = y;
+
+  // dz/dc, starting from z = c where it is 1
+  double dx = 1;
+  double dy = 0;
+
+  int iter = 0;
+
+  while( ( x * x + y * y <= DE_ESCAPE_RADIUS * DE_ESCAPE_RADIUS ) && iter < max ) {
+
+    // dz' = 2 * z * dz + 1
+    double dxt = 2 * ( x * dx - y * dy ) + 1;
+    double dyt = 2 * ( x * dy + y * dx );
+
+    double xt = x * x - y * y + x0;
+    double yt = 2 * x * y + y0;
+
+    dx = dxt;
+    dy = dyt;
+    x = xt;
+    y = yt;
+
+    iter++;
+  }
+
+  if ( iter >= max ) return -1;
+
+  double z = sqrt( x * x + y * y );
+  double dz = sqrt( dx * dx + dy * dy );
+
+  return 2 * z * log( z ) / dz;
+}
+
+/**
+ * Colors the pixel at i, j from its estimated distance, then fills every
+ * uncomputed pixel in the disk around it which is guaranteed to be outside of
+ * the set. Only rows belonging to the given work item are touched, so no
+ * other thread can be writing to them.
+ */
+void distance_fill( const work_t* work, int i, int j, double distance )
+{
+  const mandel_view_t* info = &work->job->view;
+
+  int width = bitmap_width( info->bm );
+  int height = bitmap_height( info->bm );
+
+  double pixel_width = ( info->x_max - info->x_min ) / width;
+  double pixel_height = ( info->y_max - info->y_min ) / height;
+
+  bitmap_set( info->bm, i, j, distance_to_color( distance, pixel_width ) );
+
+  // everything within a quarter of the estimate is outside of the set
+  double radius = distance / 4;
+  if ( radius < pixel_width && radius < pixel_height ) return;
+
+  int row_start = j - ( int ) ( radius / pixel_height );
+  int row_end = j + ( int ) ( radius / pixel_height );
+  if ( row_start < work->row_start ) row_start = work->row_start;
+  if ( row_end >= work->row_end ) row_end = work->row_end - 1;
+  if ( row_end >= height ) row_end = height - 1;
+
+  int row, col;
+  for ( row = row_start; row <= row_end; row++ )
+  {
+    double offset_y = ( row - j ) * pixel_height;
+    int span = ( int ) ( sqrt( radius * radius - offset_y * offset_y ) / pixel_width );
+
+    int col_start = i - span < 0 ? 0 : i - span;
+    int col_end = i + span >= width ? width - 1 : i + span;
+
+    for ( col = col_start; col <= col_end; col++ )
+    {
+      if ( bitmap_get( info->bm, col, row ) != UNCOMPUTED ) continue;
+
+      // the distance changes by at most how far we've moved from the center
+      double offset_x = ( col - i ) * pixel_width;
+      double estimate = distance - sqrt( offset_x * offset_x + offset_y * offset_y );
+
+      bitmap_set( info->bm, col, row, distance_to_color( estimate, pixel_width ) );
+    }
+  }
+}
@@ -0,0 +1,401 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <bitmap.h>
+#include <coloring.h>
+#include <raw.h>
+#include <stdbool.h>
+#include <time.h>
+
+//
+// Definitions
+//
+
+// the ways counts can be turned into colors
+#define SCHEME_CLASSIC 0
+#define SCHEME_HISTOGRAM 1
+#define SCHEME_CYCLIC 2
+
+typedef struct
+{
+  char* input;
+  char* output;
+  int thread_count;
+  int scheme;
+  double period;
+  char* palette_file;
+}
+options_t;
+
+// everything the coloring threads share
+typedef struct
+{
+  const options_t* options;
+  raw* r;
+  bitmap* bm;
+  const palette* p;
+  int max;
+
+  // the next tile to be taken by a thread
+  int next_tile;
+
+  // with SCHEME_HISTOGRAM, the first pass counts how many escaped pixels
+  // land on each whole count, and below is how many landed below it
+  bool counting;
+  int* histogram;
+  double* below;
+  double escaped;
+
+  bool failed;
+}
+coloring_t;
+
+void color_all( coloring_t* c );
+void* color_worker( void* arg );
+int color_value( coloring_t* c, double value );
+void show_help();
+int execute( int argc, char* argv[] );
+
+//
+// Implementations
+//
+
+int main( int argc, char* argv[] )
+{
+#ifndef TIMING
+  return execute( argc, argv );
+#else
+
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  int status = execute( argc, argv );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  fprintf( stderr, "%lu\n",
+      ( ( end.tv_sec - start.tv_sec ) * 1000 * 1000 * 1000 ) +
+      ( end.tv_nsec - start.tv_nsec )
+  );
+
+  return status;
+#endif
+}
+
+int execute( int argc, char* argv[] )
+{
+  int c;
+
+  // These are the default configuration values used
+  // if no command line arguments are given.
+  options_t options;
+  options.input = NULL;
+  options.output = "mandel.bmp";
+  options.thread_count = 1;
+  options.scheme = SCHEME_CLASSIC;
+  options.period = 64;
+  options.palette_file = NULL;
+
+  // For each command line argument given,
+  // override the appropriate configuration value.
+
+  while( ( c = getopt( argc, argv, "o:n:c:r:p:h" ) ) != -1 )
+  {
+    switch( c )
+    {
+      case 'o':
+        options.output = optarg;
+        break;
+
+      case 'n':
+        options.thread_count = atoi( optarg );
+        break;
+
+      case 'c':
+        if ( strcmp( optarg, "histogram" ) == 0 ) options.scheme = SCHEME_HISTOGRAM;
+        else if ( strcmp( optarg, "cyclic" ) == 0 ) options.scheme = SCHEME_CYCLIC;
+        else options.scheme = SCHEME_CLASSIC;
+        break;
+
+      case 'r':
+        options.period = atof( optarg );
+        break;
+
+      case 'p':
+        options.palette_file = optarg;
+        break;
+
+      case 'h':
+        show_help();
+        return 0;
+    }
+  }
+
+  if ( optind >= argc )
+  {
+    show_help();
+    return 1;
+  }
+  options.input = argv[ optind ];
+
+  if ( options.thread_count < 1 ) options.thread_count = 1;
+  if ( options.period <= 0 ) options.period = 64;
+
+  raw* r = raw_load( options.input );
+  if ( !r )
+  {
+    fprintf( stderr, "mandelcolor: %s isn't a raw iteration file\n", options.input );
+    return 1;
+  }
+
+  palette* p = NULL;
+  if ( options.palette_file )
+  {
+    p = palette_load( options.palette_file );
+    if ( !p )
+    {
+      fprintf( stderr, "mandelcolor: couldn't read a palette from %s\n", options.palette_file );
+      raw_delete( r );
+      return 1;
+    }
+  }
+
+  mandel_view_t view;
+  raw_describe( r, &view );
+
+#ifndef TIMING
+  printf(
+      "mandelcolor: %dx%d max=%d outfile=%s threads=%d\n",
+      raw_width( r ),
+      raw_height( r ),
+      view.max,
+      options.output,
+      options.thread_count
+  );
+#endif
+
+  coloring_t coloring;
+  memset( &coloring, 0, sizeof( coloring ) );
+  coloring.options = &options;
+  coloring.r = r;
+  coloring.bm = bitmap_create( raw_width( r ), raw_height( r ) );
+  coloring.p = p;
+  coloring.max = view.max;
+
+  color_all( &coloring );
+
+  int status = 0;
+  if ( coloring.failed )
+  {
+    fprintf( stderr, "mandelcolor: %s is damaged\n", options.input );
+    status = 1;
+  }
+  else
+  {
+    size_t length = strlen( options.output );
+    bool png = length > 4 && strcmp( options.output + length - 4, ".png" ) == 0;
+
+    if ( !( png ? bitmap_save_png( coloring.bm, options.output ) : bitmap_save( coloring.bm, options.output ) ) )
+    {
+      fprintf(
+          stderr,
+          "mandelcolor: couldn't write to %s: %s\n",
+          options.output,
+          strerror( errno )
+      );
+      status = 1;
+    }
+  }
+
+  bitmap_delete( coloring.bm );
+  if ( p ) palette_delete( p );
+  raw_delete( r );
+  free( coloring.histogram );
+  free( coloring.below );
+
+  return status;
+}
+
+/**
+ * Run one pass of the coloring threads over every tile of the file.
+ */
+static void run_pass( coloring_t* c )
+{
+  int thread_count = c->options->thread_count;
+  pthread_t* threads = malloc( sizeof( pthread_t ) * thread_count );
+
+  c->next_tile = 0;
+
+  int i;
+  for ( i = 0; i < thread_count; i++ )
+  {
+    if ( pthread_create( threads + i, NULL, color_worker, c ) )
+    {
+      perror( "Error creating thread: " );
+      exit( EXIT_FAILURE );
+    }
+  }
+
+  for ( i = 0; i < thread_count; i++ )
+  {
+    if ( pthread_join( threads[ i ], NULL ) )
+    {
+      perror( "Problem with pthread_join: " );
+    }
+  }
+
+  free( threads );
+}
+
+/**
+ * Color the whole file into the bitmap. Histogram coloring needs the counts
+ * of the whole image first, so it takes a counting pass before coloring.
+ */
+void color_all( coloring_t* c )
+{
+  if ( c->options->scheme == SCHEME_HISTOGRAM )
+  {
+    c->histogram = calloc( c->max + 1, sizeof( int ) );
+    c->below = calloc( c->max + 1, sizeof( double ) );
+
+    c->counting = true;
+    run_pass( c );
+    c->counting = false;
+
+    int k;
+    for ( k = 0; k < c->max; k++ )
+    {
+      c->below[ k ] = c->escaped;
+      c->escaped += c->histogram[ k ];
+    }
+    if ( c->escaped == 0 ) c->escaped = 1;
+  }
+
+  run_pass( c );
+}
+
+/**
+ * Take tiles until there are none left, either counting or coloring them.
+ */
+void* color_worker( void* arg )
+{
+  coloring_t* c = arg;
+
+  int width = raw_width( c->r );
+  int height = raw_height( c->r );
+  int tile_rows = raw_tile_rows( c->r );
+  int tiles = raw_tile_count( c->r );
+
+  int tile_size = width * tile_rows;
+  double* values = malloc( sizeof( double ) * ( tile_size > 0 ? tile_size : 1 ) );
+
+  // counts are kept per thread, and added to the shared histogram at the end
+  int* histogram = c->counting ? calloc( c->max + 1, sizeof( int ) ) : NULL;
+
+  while ( true )
+  {
+    int tile = __atomic_fetch_add( &c->next_tile, 1, __ATOMIC_RELAXED );
+    if ( tile >= tiles ) break;
+
+    if ( !raw_read_tile( c->r, tile, values ) )
+    {
+      __atomic_store_n( &c->failed, true, __ATOMIC_RELAXED );
+      continue;
+    }
+
+    int row_start = tile * tile_rows;
+    int row_end = row_start + tile_rows < height ? row_start + tile_rows : height;
+
+    int i, j;
+    for ( j = row_start; j < row_end; j++ )
+    {
+      const double* row = values + ( j - row_start ) * width;
+
+      for ( i = 0; i < width; i++ )
+      {
+        if ( histogram )
+        {
+          int bin = row[ i ] < 0 ? 0 : row[ i ] > c->max ? c->max : ( int ) row[ i ];
+          histogram[ bin ]++;
+        }
+        else
+        {
+          bitmap_set( c->bm, i, j, color_value( c, row[ i ] ) );
+        }
+      }
+    }
+  }
+
+  if ( histogram )
+  {
+    int k;
+    for ( k = 0; k <= c->max; k++ )
+    {
+      if ( histogram[ k ] ) __atomic_add_fetch( c->histogram + k, histogram[ k ], __ATOMIC_RELAXED );
+    }
+    free( histogram );
+  }
+
+  free( values );
+  return NULL;
+}
+
+/**
+ * The color of one pixel, whose value is a whole or smooth iteration count.
+ * With the built in palette, the classic and histogram schemes give exactly
+ * the colors mandel would have.
+ */
+int color_value( coloring_t* c, double value )
+{
+  int max = c->max;
+  const palette* p = c->p;
+
+  if ( value < 0 ) value = 0;
+
+  // the inside of the set is the first color of the palette
+  if ( value >= max )
+  {
+    return p ? palette_to_color( p, 0 ) : iteration_to_color( max, max );
+  }
+
+  if ( c->options->scheme == SCHEME_HISTOGRAM )
+  {
+    int bin = ( int ) value;
+    double within = raw_precision( c->r ) == RAW_SMOOTH ? value - bin : 0.5;
+    double fraction = ( c->below[ bin ] + c->histogram[ bin ] * within ) / c->escaped;
+
+    return p ? palette_to_color( p, 1 - fraction ) : histogram_to_color( fraction );
+  }
+
+  if ( c->options->scheme == SCHEME_CYCLIC )
+  {
+    return palette_to_color( p, fmod( value, c->options->period ) / c->options->period );
+  }
+
+  return p ? palette_to_color( p, sqrt( 1 - value / max ) ) : iteration_to_color( value, max );
+}
+
+void show_help()
+{
+  printf( "Use: mandelcolor [options] <file>\n" );
+  printf( "Where file was written by mandel -I\n" );
+  printf( "\n" );
+  printf( "Where options are:\n" );
+  printf( "-o <file>    Set output file; .png gives a PNG (default=mandel.bmp)\n" );
+  printf( "-n <threads> The number of threads to color with (default=1)\n" );
+  printf( "-c <scheme>  classic, histogram, or cyclic (default=classic)\n" );
+  printf( "-r <iters>   How many iterations the cyclic scheme takes to go\n" );
+  printf( "             through the palette (default=64)\n" );
+  printf( "-p <file>    Read the palette from file, one \"r g b\" line per entry\n" );
+  printf( "             starting from the inside of the set\n" );
+  printf( "-h           Show this help text.\n" );
+  printf( "\n" );
+  printf( "Some examples are:\n" );
+  printf( "mandel -x -0.743 -y 0.131 -s 0.01 -m 5000 -I deep.raw --precision smooth\n" );
+  printf( "mandelcolor -n 4 -c histogram -o deep.png deep.raw\n" );
+  printf( "mandelcolor -c cyclic -r 40 -p fire.palette -o fire.bmp deep.raw\n\n" );
+}
@@ -8,7 +8,10 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <coloring.h>
+#include <mandelbrot.h>
+#include <arena.h>
+#include <farm.h>
+#include <stdbool.h>
 #include <time.h>
 
 typedef struct
@@ -21,29 +24,43 @@ typedef struct
   int image_height;
   int max;
   int process_count;
+  int thread_count;
+  bool huge_pages;
+  bool histogram;
+  bool snap_to_axis;
+
+  // if not 0, the frames are farmed out to workers connecting on this port
+  int port;
+  int timeout;
+
+  // if set, every frame is looked up in one exponential map of the zoom
+  // rather than rendered on its own
+  bool exponential_map;
 }
 options_t;
 
-typedef struct 
+// the parent's bookkeeping for one slot of the frame arena
+typedef struct
 {
-  int pid;
-  char* file_name;
-  
-  bitmap* bm;
-  
-  double x_min;
-  double x_max;
-
-  double y_min;
-  double y_max;
+  // the child currently rendering into this slot, or 0 if it's free
+  pid_t child;
 
-  int max;
+  // the frame being rendered in this slot
+  int frame;
 }
-mandelbrot_t;
+slot_t;
 
-int iterations_at_point( double x, double y, int max );
+// the number of frames in a series
+#define FRAME_COUNT 50
+
+double frame_scale( options_t* options, int i );
 void spawn_children( options_t options );
-void mandelbrot_compute( mandelbrot_t* this );
+bool distribute_frames( options_t options );
+void map_frames( options_t options );
+void render_frame( options_t* options, arena* frames, mandel_view_t* view );
+bool borrow_spare_thread( void* frames );
+void release_spare_thread( void* frames );
+void save_frame( options_t* options, bitmap* bm, int frame );
 void show_help();
 int execute( int argc, char* argv[] );
 
@@ -54,13 +71,13 @@ int execute( int argc, char* argv[] );
 int main( int argc, char* argv[] )
 {
 #ifndef TIMING
-  execute( argc, argv );
+  return execute( argc, argv );
 #else
 
   struct timespec start, end;
   clock_gettime( CLOCK_MONOTONIC, &start );
 
-  execute( argc, argv );
+  int status = execute( argc, argv );
 
   clock_gettime( CLOCK_MONOTONIC, &end );
 
@@ -69,14 +86,13 @@ int main( int argc, char* argv[] )
       ( end.tv_nsec - start.tv_nsec )
   );
 
+  return status;
 #endif
-
-  return 0;
 }
 
 int execute( int argc, char* argv[] )
 {
-  char c;
+  int c;
 
   // These are the default configuration values used
   // if no command line arguments are given.
@@ -89,11 +105,18 @@ int execute( int argc, char* argv[] )
   options.image_height = 500;
   options.max = 1000;
   options.process_count = 1;
+  options.thread_count = 1;
+  options.huge_pages = false;
+  options.histogram = false;
+  options.snap_to_axis = false;
+  options.port = 0;
+  options.timeout = 0;
+  options.exponential_map = false;
 
   // For each command line argument given,
   // override the appropriate configuration value.
 
-  while( ( c = getopt( argc, argv, "x:y:s:W:H:m:o:h" ) ) != -1 ) 
+  while( ( c = getopt( argc, argv, "x:y:s:W:H:m:o:n:hLeaD:T:X" ) ) != -1 ) 
   {
     switch( c )
     {
@@ -125,6 +148,34 @@ int execute( int argc, char* argv[] )
         options.file_name = optarg;
         break;
 
+      case 'n':
+        options.thread_count = atoi( optarg );
+        break;
+
+      case 'L':
+        options.huge_pages = true;
+        break;
+
+      case 'e':
+        options.histogram = true;
+        break;
+
+      case 'a':
+        options.snap_to_axis = true;
+        break;
+
+      case 'D':
+        options.port = atoi( optarg );
+        break;
+
+      case 'T':
+        options.timeout = atoi( optarg );
+        break;
+
+      case 'X':
+        options.exponential_map = true;
+        break;
+
       case 'h':
         show_help();
         return 0;
@@ -137,16 +188,23 @@ int execute( int argc, char* argv[] )
     options.process_count = atoi( argv[ i ] );
   }
 
+  if ( options.process_count < 1 )
+  {
+    fprintf( stderr, "mandel: process_count must be at least 1\n" );
+    return 1;
+  }
+
 #ifndef TIMING
   // Display the configuration of the image.
   printf( 
-      "mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s processes=%d\n", 
+      "mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s processes=%d threads=%d\n", 
       options.x_center,
       options.y_center,
       options.scale,
       options.max,
       options.file_name,
-      options.process_count
+      options.process_count,
+      options.thread_count
   );
 #endif
 
@@ -157,143 +215,393 @@ int execute( int argc, char* argv[] )
   sprintf( file_name_format, "%s%%d.bmp", file_name );
   options.file_name = file_name_format;
    
-  spawn_children( options );
+  if ( options.port )
+  {
+    if ( options.exponential_map )
+    {
+      fprintf( stderr, "mandel: -X isn't supported with -D, rendering every frame\n" );
+    }
+    if ( !distribute_frames( options ) ) return 1;
+  }
+  else if ( options.exponential_map )
+  {
+    map_frames( options );
+  }
+  else
+  {
+    spawn_children( options );
+  }
 
   return 0;
 }
 
+/**
+ * The scale of the i-th frame of the series, counting from the widest. The
+ * frames step evenly from 2.0 down to options->scale, so there are
+ * FRAME_COUNT - 1 steps between them. Frame i is saved as number
+ * FRAME_COUNT - i, so frame1 is the deepest.
+ */
+double frame_scale( options_t* options, int i )
+{
+  double scale = 2.0;
+  double step = ( scale - options->scale ) / ( FRAME_COUNT - 1 ); // fencepost problem
+
+  // stepped down one frame at a time rather than as 2.0 - i * step, which
+  // rounds differently and would shift the frames by a few pixels
+  while ( i-- > 0 )
+  {
+    scale -= step;
+  }
+  return scale;
+}
+
 void spawn_children( options_t options )
 {
-  int remaining = 50;
+  int remaining = FRAME_COUNT;
   int active = 0;
-  double scale = 2.0;
-  double step = ( scale - options.scale ) / ( remaining - 1 ); // fencepost problem
-
-  mandelbrot_t mandel;
-  mandel.bm = bitmap_create( options.image_width, options.image_height );
-  bitmap_reset( mandel.bm, MAKE_RGBA( 0, 0, 255, 0 ) );
-  
-  mandel.max = options.max;
-  
-  for ( ; remaining > 0; remaining-- )
+
+  // every running child gets its own slot in the shared arena to render into,
+  // and the parent saves the frame out of that slot once the child exits
+  int width = options.image_width;
+  int height = options.image_height;
+  size_t frame_size = sizeof( int ) * width * height;
+
+  arena* frames = arena_create( options.process_count, frame_size, options.huge_pages );
+  if ( !frames )
   {
-    pid_t child = fork();
+    perror( "Failed to create the frame arena" );
+    exit( 1 );
+  }
 
-    // failed to fork
-    if ( child < 0 )
+  slot_t* slots = calloc( options.process_count, sizeof( slot_t ) );
+
+  int slot;
+  while ( remaining > 0 || active > 0 )
+  {
+    // find a free slot for the next frame, if there is one to render
+    for ( slot = 0; slot < options.process_count; slot++ )
     {
-      fprintf( stderr, "Failed to spawn process!\n" );
-      exit( 1 );
+      if ( slots[ slot ].child == 0 ) break;
     }
-    // we're in the child
-    else if ( child == 0 )
+
+    if ( remaining > 0 && slot < options.process_count )
     {
-      mandel.file_name = calloc( sizeof( char ), 2048 );
-      sprintf( mandel.file_name, options.file_name, remaining );
-
-      mandel.pid = remaining;
-      mandel.x_min = options.x_center - scale;
-      mandel.x_max = options.x_center + scale;
-      mandel.y_min = options.y_center - scale;
-      mandel.y_max = options.y_center + scale;
-      fflush( stdout );
-
-      mandelbrot_compute( &mandel );
-      exit( 0 );
+      pid_t child = fork();
+
+      // failed to fork
+      if ( child < 0 )
+      {
+        fprintf( stderr, "Failed to spawn process!\n" );
+        exit( 1 );
+      }
+      // we're in the child
+      else if ( child == 0 )
+      {
+        double scale = frame_scale( &options, FRAME_COUNT - remaining );
+        mandel_view_t view = {
+          .bm = bitmap_wrap( width, height, arena_slot( frames, slot ) ),
+          .x_min = options.x_center - scale,
+          .x_max = options.x_center + scale,
+          .y_min = options.y_center - scale,
+          .y_max = options.y_center + scale,
+          .max = options.max,
+          .distance_estimation = false,
+          .histogram = options.histogram
+        };
+        fflush( stdout );
+
+        if ( options.snap_to_axis )
+        {
+          mandel_view_snap_to_axis( &view );
+        }
+
+        render_frame( &options, frames, &view );
+        exit( 0 );
+      }
+
+      // => we're in the parent, so continue dispatching new images
+      slots[ slot ].child = child;
+      slots[ slot ].frame = remaining;
+
+      remaining--;
+      active++;
+
+      // once the last frame is out, any slot which is still free will never
+      // be used, so its threads can go to the frames which are running
+      if ( remaining == 0 )
+      {
+        arena_give_threads( frames, ( options.process_count - active ) * options.thread_count );
+      }
+      continue;
     }
 
-    // => we're in the parent, so continue dispatching new images
-    scale -= step;
-    active++;
+    // every slot is busy (or there's nothing left to start), so wait for a
+    // child to finish and write its frame out while the others keep going
+    int status;
+    pid_t child = wait( &status );
+    if ( child < 0 ) break;
 
-    // if we have too many running processes, then we're going to wait
-    // until we get down to the point where we can spawn another process
-    while ( active >= options.process_count )
+    for ( slot = 0; slot < options.process_count; slot++ )
+    {
+      if ( slots[ slot ].child == child ) break;
+    }
+    if ( slot == options.process_count ) continue;
+
+    if ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 )
+    {
+      bitmap* bm = bitmap_wrap( width, height, arena_slot( frames, slot ) );
+      save_frame( &options, bm, slots[ slot ].frame );
+      bitmap_delete( bm );
+    }
+    else
     {
-      wait( NULL );
-      active--;
+      fprintf( stderr, "mandel: frame %d failed to render\n", slots[ slot ].frame );
+    }
+
+    slots[ slot ].child = 0;
+    active--;
+
+    // nothing else will be started in this slot, so lend out its threads
+    if ( remaining == 0 )
+    {
+      arena_give_threads( frames, options.thread_count );
     }
   }
 
-  // wait for any stragglers
-  while ( wait( NULL ) > 0 );
+  free( slots );
+  arena_delete( frames );
 }
 
 /**
- * Compute an entire Mandelbrot image, writing each point to the given bitmap.
- * Scale the image to the range (xmin-xmax,ymin-ymax), limiting iterations to "max"
+ * Farm the same series of frames out to workers over TCP instead of to
+ * forked children. process_count workers are started on this host, and any
+ * number more can join from other hosts with mandelworker. Returns false if
+ * some frames couldn't be rendered.
  */
-void mandelbrot_compute( mandelbrot_t* this )
+bool distribute_frames( options_t options )
 {
-  int i,j;
+  int frame_count = FRAME_COUNT;
 
-  int width = bitmap_width( this->bm );
-  int height = bitmap_height( this->bm );
+  if ( options.histogram )
+  {
+    fprintf( stderr, "mandel: -e isn't supported with -D, using the usual colors\n" );
+  }
 
-  // For every pixel in the image...
+  farm_frame_t* frames = calloc( frame_count, sizeof( farm_frame_t ) );
 
-  for( j = 0; j < height; j++ )
+  int i;
+  for ( i = 0; i < frame_count; i++ )
   {
+    double scale = frame_scale( &options, i );
+    mandel_view_t view = {
+      .bm = bitmap_wrap( options.image_width, options.image_height, NULL ),
+      .x_min = options.x_center - scale,
+      .x_max = options.x_center + scale,
+      .y_min = options.y_center - scale,
+      .y_max = options.y_center + scale,
+      .max = options.max
+    };
+
+    if ( options.snap_to_axis )
+    {
+      mandel_view_snap_to_axis( &view );
+    }
+    bitmap_delete( view.bm );
+
+    char* file_name = malloc( 2048 );
+    snprintf( file_name, 2048, options.file_name, frame_count - i );
+
+    frames[ i ].x_min = view.x_min;
+    frames[ i ].x_max = view.x_max;
+    frames[ i ].y_min = view.y_min;
+    frames[ i ].y_max = view.y_max;
+    frames[ i ].width = options.image_width;
+    frames[ i ].height = options.image_height;
+    frames[ i ].max = options.max;
+    frames[ i ].file_name = file_name;
+  }
 
-    for( i = 0; i < width; i++ )
+  int listener = farm_listen( options.port );
+  if ( listener < 0 )
+  {
+    perror( "Failed to listen for workers" );
+    exit( 1 );
+  }
+
+  // the local workers find the coordinator the same way remote ones do
+  fflush( stdout );
+  for ( i = 0; i < options.process_count; i++ )
+  {
+    pid_t child = fork();
+    if ( child < 0 )
+    {
+      fprintf( stderr, "Failed to spawn process!\n" );
+      exit( 1 );
+    }
+    else if ( child == 0 )
     {
+      close( listener );
+      exit( farm_work( "localhost", options.port, options.thread_count ) ? 0 : 1 );
+    }
+  }
 
-      // Determine the point in x,y space for that pixel.
-      double x = this->x_min + i * ( this->x_max - this->x_min ) / width;
-      double y = this->y_min + j * ( this->y_max - this->y_min ) / height;
+  farm_options_t farm_options = {
+    .tile_rows = 32,
+    .timeout = options.timeout,
+    .local_threads = options.process_count * options.thread_count
+  };
 
-      // Compute the iterations at that point.
-      int iters = iterations_at_point( x, y, this->max );
+  bool finished = farm_coordinate( listener, frames, frame_count, &farm_options );
+  close( listener );
 
-      // Set the pixel in the bitmap.
-      bitmap_set( this->bm, i, j, iters );
-    }
+  // the local workers exit as soon as they're told there's nothing left
+  while ( wait( NULL ) > 0 );
+
+  for ( i = 0; i < frame_count; i++ )
+  {
+    free( ( char* ) frames[ i ].file_name );
   }
+  free( frames );
 
-  // Save the image in the stated file.
-  if( !bitmap_save( this->bm, this->file_name ) ) 
+  return finished;
+}
+
+/**
+ * Render the same series of frames from a single exponential map of the
+ * zoom. The frames are nested views around one center, so rather than
+ * computing every one of them, the map is computed once, at the resolution
+ * each distance from the center needs, and each frame is looked up in it.
+ * Only a few pixels in the middle of each frame are computed directly. All
+ * process_count * thread_count threads work on the map, and then on each
+ * frame in turn.
+ */
+void map_frames( options_t options )
+{
+  int frame_count = FRAME_COUNT;
+  double widest = frame_scale( &options, 0 );
+
+  if ( options.snap_to_axis )
+  {
+    fprintf( stderr, "mandel: -a isn't needed with -X, the map mirrors itself\n" );
+  }
+
+  mandel_renderer* renderer = mandel_renderer_create( options.process_count * options.thread_count );
+
+  mandel_zoom* zoom = mandel_zoom_create(
+      renderer,
+      options.x_center,
+      options.y_center,
+      widest < options.scale ? widest : options.scale,
+      widest < options.scale ? options.scale : widest,
+      options.image_width,
+      options.image_height,
+      options.max );
+
+  if ( !zoom )
+  {
+    fprintf( stderr, "mandel: couldn't map a zoom down to scale %lf\n", options.scale );
+    exit( 1 );
+  }
+
+#ifndef TIMING
+  printf(
+      "mandel: mapped the zoom with %zu points, where the frames have %zu pixels\n",
+      mandel_zoom_points( zoom ),
+      ( size_t ) frame_count * options.image_width * options.image_height
+  );
+#endif
+
+  bitmap* bm = bitmap_create( options.image_width, options.image_height );
+
+  int i;
+  for ( i = 0; i < frame_count; i++ )
+  {
+    double scale = frame_scale( &options, i );
+    mandel_view_t view = {
+      .bm = bm,
+      .x_min = options.x_center - scale,
+      .x_max = options.x_center + scale,
+      .y_min = options.y_center - scale,
+      .y_max = options.y_center + scale,
+      .max = options.max,
+      .distance_estimation = false,
+      .histogram = options.histogram
+    };
+
+    mandel_zoom_frame( zoom, renderer, &view );
+    save_frame( &options, bm, frame_count - i );
+  }
+
+  bitmap_delete( bm );
+  mandel_zoom_delete( zoom );
+  mandel_renderer_delete( renderer );
+}
+
+/**
+ * Save the given frame to its numbered file.
+ */
+void save_frame( options_t* options, bitmap* bm, int frame )
+{
+  char file_name[ 2048 ];
+  snprintf( file_name, sizeof( file_name ), options->file_name, frame );
+
+  if( !bitmap_save( bm, file_name ) ) 
   {
     fprintf( 
         stderr, 
         "%d [%d] mandel: couldn't write to %s: %s\n",
-        this->pid,
+        frame,
         getpid(),
-        this->file_name,
+        file_name,
         strerror( errno ) 
     );
     fflush( stderr );
-    fflush( stdout );
-
-    exit( 1 );
-    return;
   }
-
-  fflush( stdout );
 }
 
 /**
- * Return the number of iterations at point x, y
- * in the Mandelbrot space, up to a maximum of max.
+ * Render a single frame in the child with thread_count threads, plus however
+ * many spare threads can be borrowed from the arena while the frame is running.
  */
-int iterations_at_point( double x, double y, int max )
+void render_frame( options_t* options, arena* frames, mandel_view_t* view )
 {
-  double x0 = x;
-  double y0 = y;
-
-  int iter = 0;
+  mandel_renderer* renderer = mandel_renderer_create( options->thread_count );
+
+  mandel_lender_t lender = {
+    .borrow = borrow_spare_thread,
+    .release = release_spare_thread,
+    .data = frames,
+    .max = options->thread_count * arena_slot_count( frames )
+  };
+  mandel_renderer_lend( renderer, &lender );
+
+  // rows are handed out one at a time, so borrowed threads always have
+  // something to pick up
+  mandel_schedule_t schedule = {
+    .thread_count = options->thread_count,
+    .work_stealing = true,
+    .uniform_rows = false,
+    .tile_rows = 1
+  };
+
+  mandel_job* job = mandel_render( renderer, view, &schedule, NULL, NULL );
+  mandel_job_wait( job );
+  mandel_job_delete( job );
+
+  // this also waits for the borrowed threads to hand themselves back
+  mandel_renderer_delete( renderer );
 
-  while( ( x * x + y * y <= 4 ) && iter < max ) {
-
-    double xt = x * x - y * y + x0;
-    double yt = 2 * x * y + y0;
-
-    x = xt;
-    y = yt;
+  fflush( stdout );
+}
 
-    iter++;
-  }
+bool borrow_spare_thread( void* frames )
+{
+  return arena_take_thread( frames );
+}
 
-  return iteration_to_color( iter, max );
+void release_spare_thread( void* frames )
+{
+  arena_give_threads( frames, 1 );
 }
 
 void show_help()
@@ -309,6 +617,14 @@ void show_help()
   printf( "-W <pixels> Width of the image in pixels. (default=500)\n ");
   printf( "-H <pixels> Height of the image in pixels. (default=500)\n ");
   printf( "-o <file>   Set output file. (default=mandel.bmp)\n ");
+  printf( "-n <threads> Number of threads to render each frame with (default=1)\n ");
+  printf( "-L          Back the shared frame buffers with huge pages\n ");
+  printf( "-e          Color each frame by histogram equalization\n ");
+  printf( "-a          Nudge frames crossing the real axis so half can be mirrored\n ");
+  printf( "-D <port>   Farm the frames out to workers connecting on port, starting\n ");
+  printf( "            process_count of them on this host\n ");
+  printf( "-T <secs>   With -D, retry the tiles of workers quiet for this long\n ");
+  printf( "-X          Look every frame up in one exponential map of the zoom\n ");
   printf( "-h          Show this help text.\n ");
   printf( "\n" );
   printf( "Some examples are:\n" );
@@ -0,0 +1,92 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <farm.h>
+#include <stdbool.h>
+#include <time.h>
+
+void show_help();
+int execute( int argc, char* argv[] );
+
+//
+// Implementations
+//
+
+int main( int argc, char* argv[] )
+{
+#ifndef TIMING
+  return execute( argc, argv );
+#else
+
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  int status = execute( argc, argv );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+
+  fprintf( stderr, "%lu\n",
+      ( ( end.tv_sec - start.tv_sec ) * 1000 * 1000 * 1000 ) +
+      ( end.tv_nsec - start.tv_nsec )
+  );
+
+  return status;
+#endif
+}
+
+int execute( int argc, char* argv[] )
+{
+  int c;
+
+  // These are the default configuration values used
+  // if no command line arguments are given.
+  int thread_count = 1;
+
+  // For each command line argument given,
+  // override the appropriate configuration value.
+
+  while( ( c = getopt( argc, argv, "n:h" ) ) != -1 )
+  {
+    switch( c )
+    {
+      case 'n':
+        thread_count = atoi( optarg );
+        break;
+
+      case 'h':
+        show_help();
+        return 0;
+    }
+  }
+
+  if ( optind + 2 > argc )
+  {
+    show_help();
+    return 1;
+  }
+
+  const char* host = argv[ optind ];
+  int port = atoi( argv[ optind + 1 ] );
+
+  if ( thread_count < 1 ) thread_count = 1;
+
+#ifndef TIMING
+  printf( "mandelworker: coordinator=%s:%d threads=%d\n", host, port, thread_count );
+  fflush( stdout );
+#endif
+
+  return farm_work( host, port, thread_count ) ? 0 : 1;
+}
+
+void show_help()
+{
+  printf( "Use: mandelworker [options] <host> <port>\n" );
+  printf( "Where host and port are those of a coordinator started by mandelseries -D\n" );
+  printf( "\n" );
+  printf( "Where options are:\n" );
+  printf( "-n <threads> The number of threads to render with (default=1)\n" );
+  printf( "-h           Show this help text.\n" );
+  printf( "\n" );
+  printf( "An example is:\n" );
+  printf( "mandelworker -n 8 render-host 7070\n\n" );
+}
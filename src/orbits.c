@@ -0,0 +1,170 @@
+#include <mandelbrot.h>
+#include <raw.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Orbit state files are laid out as:
+//
+//   orbits_header_t
+//   int32_t iterations[ width * height ]
+//   double  z[ width * height ][ 2 ]      at z_offset
+//
+// in the byte order of the host that wrote them. z starts on an 8 byte
+// boundary, so both arrays can be used straight out of a mapping of the
+// file. z is kept for escaped pixels too, since their last z is what smooth
+// coloring needs.
+
+#define ORBITS_MAGIC "MORB"
+#define ORBITS_VERSION 2
+
+typedef struct
+{
+  char magic[ 4 ];
+  int32_t version;
+
+  int32_t width;
+  int32_t height;
+  int32_t max;
+  uint32_t byte_order;
+
+  double x_min;
+  double x_max;
+  double y_min;
+  double y_max;
+
+  // where z starts in the file
+  int64_t z_offset;
+}
+orbits_header_t;
+
+static size_t z_offset( size_t pixels )
+{
+  size_t offset = sizeof( orbits_header_t ) + sizeof( int32_t ) * pixels;
+
+  return ( offset + sizeof( double ) - 1 ) & ~( sizeof( double ) - 1 );
+}
+
+/**
+ * Write the orbit state of the given view out to path. The state is written
+ * to a new file which then replaces path, so state which was loaded from
+ * path, and is still mapped, is never truncated from under the mapping.
+ */
+bool mandel_orbits_save( const mandel_view_t* view, const char* path )
+{
+  const mandel_orbits_t* orbits = view->orbits;
+  size_t pixels = ( size_t ) orbits->width * orbits->height;
+
+  orbits_header_t header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, ORBITS_MAGIC, 4 );
+  header.version = ORBITS_VERSION;
+  header.width = orbits->width;
+  header.height = orbits->height;
+  header.max = orbits->max;
+  header.byte_order = RAW_BYTE_ORDER;
+  header.x_min = view->x_min;
+  header.x_max = view->x_max;
+  header.y_min = view->y_min;
+  header.y_max = view->y_max;
+  header.z_offset = z_offset( pixels );
+
+  size_t length = strlen( path );
+  char* temporary = malloc( length + 5 );
+  if ( !temporary ) return false;
+  snprintf( temporary, length + 5, "%s.new", path );
+
+  FILE* file = fopen( temporary, "wb" );
+  if ( !file )
+  {
+    free( temporary );
+    return false;
+  }
+
+  static const char padding[ sizeof( double ) ] = { 0 };
+  size_t padding_size = header.z_offset - sizeof( header ) - sizeof( int32_t ) * pixels;
+
+  bool saved =
+    fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+    fwrite( orbits->iterations, sizeof( int32_t ), pixels, file ) == pixels &&
+    fwrite( padding, 1, padding_size, file ) == padding_size &&
+    fwrite( orbits->z, sizeof( double ) * 2, pixels, file ) == pixels;
+
+  saved = fclose( file ) == 0 && saved;
+  saved = saved && rename( temporary, path ) == 0;
+
+  if ( !saved ) unlink( temporary );
+  free( temporary );
+
+  return saved;
+}
+
+/**
+ * Load the orbit state saved at path, if it was saved for exactly the same
+ * view as the one given. Returns NULL if it can't be used, with errno set
+ * to ENOENT if there's no file, or EINVAL if the file holds something else,
+ * such as the state of another view or of a larger max.
+ *
+ * The state isn't copied out of the file: its arrays point into a private
+ * mapping of it, so only the pages which the render writes to are copied.
+ */
+mandel_orbits_t* mandel_orbits_load( const mandel_view_t* view, const char* path )
+{
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) return NULL;
+
+  struct stat info;
+  if ( fstat( fd, &info ) < 0 || ( size_t ) info.st_size < sizeof( orbits_header_t ) )
+  {
+    close( fd );
+    errno = EINVAL;
+    return NULL;
+  }
+
+  void* base = mmap( NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( base == MAP_FAILED ) return NULL;
+
+  const orbits_header_t* header = base;
+  size_t pixels = ( size_t ) header->width * header->height;
+
+  // the saved state has to line up exactly with the pixels being rendered,
+  // and can only be continued to a larger max
+  bool matches =
+    memcmp( header->magic, ORBITS_MAGIC, 4 ) == 0 &&
+    header->version == ORBITS_VERSION &&
+    header->byte_order == RAW_BYTE_ORDER &&
+    header->width == bitmap_width( view->bm ) &&
+    header->height == bitmap_height( view->bm ) &&
+    ( size_t ) header->z_offset == z_offset( pixels ) &&
+    ( size_t ) info.st_size == z_offset( pixels ) + sizeof( double ) * 2 * pixels &&
+    header->x_min == view->x_min &&
+    header->x_max == view->x_max &&
+    header->y_min == view->y_min &&
+    header->y_max == view->y_max &&
+    header->max <= view->max;
+
+  mandel_orbits_t* orbits = matches ? malloc( sizeof( *orbits ) ) : NULL;
+  if ( !orbits )
+  {
+    munmap( base, info.st_size );
+    errno = matches ? ENOMEM : EINVAL;
+    return NULL;
+  }
+
+  orbits->width = header->width;
+  orbits->height = header->height;
+  orbits->max = header->max;
+  orbits->iterations = ( int* ) ( header + 1 );
+  orbits->z = ( double* ) ( ( char* ) base + header->z_offset );
+  orbits->mapping = base;
+  orbits->mapping_size = info.st_size;
+
+  return orbits;
+}
@@ -0,0 +1,91 @@
+#include <profile.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Where this host's profile is kept: $HOME/.mandel/<hostname>.profile
+ */
+const char* profile_path()
+{
+  static char path[ 1024 ] = "";
+
+  if ( path[ 0 ] == '\0' )
+  {
+    const char* home = getenv( "HOME" );
+    if ( !home ) home = ".";
+
+    char host[ 256 ];
+    if ( gethostname( host, sizeof( host ) ) < 0 )
+    {
+      strcpy( host, "localhost" );
+    }
+    host[ sizeof( host ) - 1 ] = '\0';
+
+    snprintf( path, sizeof( path ), "%s/.mandel/%s.profile", home, host );
+  }
+
+  return path;
+}
+
+/**
+ * Load this host's profile into the given struct. Entries missing from the
+ * file are left alone. Returns false if there's no profile for this host.
+ */
+bool profile_load( profile_t* profile )
+{
+  FILE* file = fopen( profile_path(), "r" );
+  if ( !file ) return false;
+
+  char key[ 64 ];
+  int value;
+  while ( fscanf( file, " %63[^=]=%d", key, &value ) == 2 )
+  {
+    if ( strcmp( key, "threads" ) == 0 )
+    {
+      profile->thread_count = value;
+    }
+    else if ( strcmp( key, "work_stealing" ) == 0 )
+    {
+      profile->work_stealing = value;
+    }
+    else if ( strcmp( key, "uniform_rows" ) == 0 )
+    {
+      profile->uniform_rows = value;
+    }
+    else if ( strcmp( key, "tile_rows" ) == 0 )
+    {
+      profile->tile_rows = value;
+    }
+  }
+
+  fclose( file );
+  return true;
+}
+
+/**
+ * Write the given profile out as this host's profile.
+ */
+bool profile_save( const profile_t* profile )
+{
+  const char* path = profile_path();
+
+  // make sure the directory exists first
+  char directory[ 1024 ];
+  strcpy( directory, path );
+  *strrchr( directory, '/' ) = '\0';
+  if ( mkdir( directory, 0755 ) < 0 && errno != EEXIST ) return false;
+
+  FILE* file = fopen( path, "w" );
+  if ( !file ) return false;
+
+  fprintf( file, "threads=%d\n", profile->thread_count );
+  fprintf( file, "work_stealing=%d\n", profile->work_stealing );
+  fprintf( file, "uniform_rows=%d\n", profile->uniform_rows );
+  fprintf( file, "tile_rows=%d\n", profile->tile_rows );
+
+  return fclose( file ) == 0;
+}
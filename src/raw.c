@@ -0,0 +1,380 @@
+#include <raw.h>
+#include <farm.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RAW_MAGIC "MRAW"
+#define RAW_VERSION 2
+
+// uncompressed planes start on this boundary
+#define RAW_ALIGNMENT 64
+
+// how many rows go in each tile when the caller doesn't say
+#define RAW_TILE_ROWS 16
+
+typedef struct
+{
+  char magic[ 4 ];
+  int32_t version;
+
+  int32_t width;
+  int32_t height;
+  int32_t max;
+
+  int32_t precision;
+  int32_t tile_rows;
+  int32_t compressed;
+
+  uint32_t byte_order;
+  int32_t unused;
+
+  double x_min;
+  double x_max;
+  double y_min;
+  double y_max;
+
+  // where the plane starts, after the header and the tile offsets
+  int64_t data_offset;
+}
+raw_header_t;
+
+struct raw
+{
+  raw_header_t header;
+
+  const unsigned char* map;
+  size_t size;
+
+  // only for compressed files
+  const uint64_t* offsets;
+};
+
+static size_t value_size( int precision )
+{
+  return precision == RAW_U16 ? sizeof( uint16_t ) : sizeof( uint32_t );
+}
+
+static int tile_count( int height, int tile_rows )
+{
+  return ( height + tile_rows - 1 ) / tile_rows;
+}
+
+/**
+ * The smooth iteration count of a pixel from where its orbit escaped.
+ */
+static float smooth_iterations( int iters, int max, const double* z )
+{
+  if ( iters >= max ) return max;
+
+  double modulus = sqrt( z[ 0 ] * z[ 0 ] + z[ 1 ] * z[ 1 ] );
+  if ( modulus <= 1 ) return iters;
+
+  double smooth = iters + 1 - log( log( modulus ) ) / log( 2 );
+  return smooth < 0 ? 0 : smooth;
+}
+
+/**
+ * Write the iterations of a view, which must have been rendered with orbit
+ * state, to path.
+ */
+bool raw_save( const mandel_view_t* view, int precision, int tile_rows, bool compressed, const char* path )
+{
+  const mandel_orbits_t* orbits = view->orbits;
+  if ( !orbits ) return false;
+
+  if ( tile_rows < 1 ) tile_rows = RAW_TILE_ROWS;
+
+  int width = orbits->width;
+  int height = orbits->height;
+  int tiles = tile_count( height, tile_rows );
+
+  raw_header_t header;
+  memset( &header, 0, sizeof( header ) );
+  memcpy( header.magic, RAW_MAGIC, 4 );
+  header.version = RAW_VERSION;
+  header.width = width;
+  header.height = height;
+  header.max = view->max;
+  header.precision = precision;
+  header.tile_rows = tile_rows;
+  header.compressed = compressed;
+  header.byte_order = RAW_BYTE_ORDER;
+  header.x_min = view->x_min;
+  header.x_max = view->x_max;
+  header.y_min = view->y_min;
+  header.y_max = view->y_max;
+
+  size_t index_size = compressed ? sizeof( uint64_t ) * ( tiles + 1 ) : 0;
+  header.data_offset = sizeof( header ) + index_size;
+  if ( !compressed )
+  {
+    header.data_offset = ( header.data_offset + RAW_ALIGNMENT - 1 ) / RAW_ALIGNMENT * RAW_ALIGNMENT;
+  }
+
+  FILE* file = fopen( path, "wb" );
+  if ( !file ) return false;
+
+  bool ok = fwrite( &header, sizeof( header ), 1, file ) == 1;
+
+  // the offsets are filled in once we know how big each tile came out
+  uint64_t* offsets = calloc( tiles + 1, sizeof( uint64_t ) );
+  if ( compressed )
+  {
+    ok = ok && fwrite( offsets, sizeof( uint64_t ), tiles + 1, file ) == ( size_t ) tiles + 1;
+  }
+  else
+  {
+    ok = ok && fseek( file, header.data_offset, SEEK_SET ) == 0;
+  }
+
+  int tile_pixels = width * tile_rows;
+  int32_t* values = malloc( sizeof( int32_t ) * ( tile_pixels ? tile_pixels : 1 ) );
+  unsigned char* encoded = malloc( farm_encode_bound( tile_pixels ) + 1 );
+
+  uint64_t offset = header.data_offset;
+  int t;
+  for ( t = 0; t < tiles && ok; t++ )
+  {
+    int row_start = t * tile_rows;
+    int row_end = row_start + tile_rows < height ? row_start + tile_rows : height;
+    int count = width * ( row_end - row_start );
+
+    int k;
+    for ( k = 0; k < count; k++ )
+    {
+      size_t index = ( size_t ) row_start * width + k;
+      int iters = orbits->iterations[ index ];
+
+      if ( precision == RAW_SMOOTH )
+      {
+        float smooth = smooth_iterations( iters, view->max, orbits->z + index * 2 );
+        memcpy( values + k, &smooth, sizeof( smooth ) );
+      }
+      else if ( precision == RAW_U16 )
+      {
+        uint16_t small = iters > UINT16_MAX ? UINT16_MAX : iters;
+        memcpy( ( uint16_t* ) values + k, &small, sizeof( small ) );
+      }
+      else
+      {
+        values[ k ] = iters;
+      }
+    }
+
+    offsets[ t ] = offset;
+
+    if ( compressed )
+    {
+      // 16 bit values are compressed the same way, just widened first
+      if ( precision == RAW_U16 )
+      {
+        for ( k = count - 1; k >= 0; k-- )
+        {
+          values[ k ] = ( ( uint16_t* ) values )[ k ];
+        }
+      }
+
+      size_t size = farm_encode( values, count, encoded );
+      ok = fwrite( encoded, 1, size, file ) == size;
+      offset += size;
+    }
+    else
+    {
+      size_t size = value_size( precision ) * count;
+      ok = fwrite( values, 1, size, file ) == size;
+      offset += size;
+    }
+  }
+  offsets[ tiles ] = offset;
+
+  if ( ok && compressed )
+  {
+    ok = fseek( file, sizeof( header ), SEEK_SET ) == 0 &&
+      fwrite( offsets, sizeof( uint64_t ), tiles + 1, file ) == ( size_t ) tiles + 1;
+  }
+
+  free( encoded );
+  free( values );
+  free( offsets );
+
+  return fclose( file ) == 0 && ok;
+}
+
+/**
+ * Map a raw iteration file, returning NULL if it can't be read or isn't one.
+ */
+raw* raw_load( const char* path )
+{
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) return NULL;
+
+  struct stat info;
+  if ( fstat( fd, &info ) < 0 || ( size_t ) info.st_size < sizeof( raw_header_t ) )
+  {
+    close( fd );
+    return NULL;
+  }
+
+  void* map = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) return NULL;
+
+  raw* r = calloc( 1, sizeof( *r ) );
+  r->map = map;
+  r->size = info.st_size;
+  memcpy( &r->header, map, sizeof( raw_header_t ) );
+
+  const raw_header_t* h = &r->header;
+  bool valid =
+    memcmp( h->magic, RAW_MAGIC, 4 ) == 0 &&
+    h->version == RAW_VERSION &&
+    h->byte_order == RAW_BYTE_ORDER &&
+    h->width >= 0 && h->height >= 0 && h->max > 0 &&
+    h->tile_rows > 0 &&
+    ( h->precision == RAW_U16 || h->precision == RAW_U32 || h->precision == RAW_SMOOTH ) &&
+    h->data_offset >= ( int64_t ) sizeof( raw_header_t ) &&
+    ( uint64_t ) h->data_offset <= r->size;
+
+  int tiles = valid ? tile_count( h->height, h->tile_rows ) : 0;
+
+  if ( valid && h->compressed )
+  {
+    size_t index_size = sizeof( uint64_t ) * ( tiles + 1 );
+    valid = sizeof( raw_header_t ) + index_size <= r->size;
+
+    if ( valid )
+    {
+      r->offsets = ( const uint64_t* ) ( r->map + sizeof( raw_header_t ) );
+
+      // every tile has to be inside the file, in order
+      int t;
+      for ( t = 0; t < tiles && valid; t++ )
+      {
+        valid = r->offsets[ t ] <= r->offsets[ t + 1 ] && r->offsets[ t + 1 ] <= r->size;
+      }
+    }
+  }
+  else if ( valid )
+  {
+    size_t plane = value_size( h->precision ) * h->width * ( size_t ) h->height;
+    valid = h->data_offset + plane <= r->size;
+  }
+
+  if ( !valid )
+  {
+    raw_delete( r );
+    return NULL;
+  }
+
+  return r;
+}
+
+void raw_delete( raw* r )
+{
+  munmap( ( void* ) r->map, r->size );
+  free( r );
+}
+
+int raw_width( raw* r )
+{
+  return r->header.width;
+}
+
+int raw_height( raw* r )
+{
+  return r->header.height;
+}
+
+int raw_precision( raw* r )
+{
+  return r->header.precision;
+}
+
+int raw_tile_rows( raw* r )
+{
+  return r->header.tile_rows;
+}
+
+int raw_tile_count( raw* r )
+{
+  return tile_count( r->header.height, r->header.tile_rows );
+}
+
+/**
+ * Fill in the bounds and max of the view the file was rendered from.
+ */
+void raw_describe( raw* r, mandel_view_t* view )
+{
+  view->x_min = r->header.x_min;
+  view->x_max = r->header.x_max;
+  view->y_min = r->header.y_min;
+  view->y_max = r->header.y_max;
+  view->max = r->header.max;
+}
+
+/**
+ * Read every value in one tile, of up to tile_rows rows, into values.
+ */
+bool raw_read_tile( raw* r, int tile, double* values )
+{
+  const raw_header_t* h = &r->header;
+
+  int row_start = tile * h->tile_rows;
+  int row_end = row_start + h->tile_rows < h->height ? row_start + h->tile_rows : h->height;
+  int count = h->width * ( row_end - row_start );
+  int k;
+
+  if ( !h->compressed )
+  {
+    const unsigned char* plane = r->map + h->data_offset + value_size( h->precision ) * ( size_t ) row_start * h->width;
+
+    for ( k = 0; k < count; k++ )
+    {
+      if ( h->precision == RAW_U16 )
+      {
+        values[ k ] = ( ( const uint16_t* ) plane )[ k ];
+      }
+      else if ( h->precision == RAW_U32 )
+      {
+        values[ k ] = ( ( const uint32_t* ) plane )[ k ];
+      }
+      else
+      {
+        values[ k ] = ( ( const float* ) plane )[ k ];
+      }
+    }
+
+    return true;
+  }
+
+  int32_t* decoded = malloc( sizeof( int32_t ) * ( count ? count : 1 ) );
+  bool ok = farm_decode(
+      r->map + r->offsets[ tile ],
+      r->offsets[ tile + 1 ] - r->offsets[ tile ],
+      decoded,
+      count );
+
+  for ( k = 0; k < count && ok; k++ )
+  {
+    if ( h->precision == RAW_SMOOTH )
+    {
+      float smooth;
+      memcpy( &smooth, decoded + k, sizeof( smooth ) );
+      values[ k ] = smooth;
+    }
+    else
+    {
+      values[ k ] = ( uint32_t ) decoded[ k ];
+    }
+  }
+
+  free( decoded );
+  return ok;
+}
@@ -0,0 +1,237 @@
+#include <mandelbrot.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * An interactive view which is moved around one step at a time. After each
+ * step, whatever part of the last image still lines up with the pixel grid
+ * is carried over, and only the newly exposed pixels are rendered.
+ */
+struct mandel_session
+{
+  mandel_renderer* renderer;
+  mandel_schedule_t schedule;
+
+  // the current view, which renders into the caller's bitmap
+  mandel_view_t view;
+
+  // the last image, which the next one is built from
+  int* previous;
+
+  // which pixels of the next image were carried over from the last one
+  unsigned char* known;
+};
+
+int session_render( mandel_session* s );
+void session_step( mandel_session* s );
+
+/**
+ * Start a session at the given view, rendering it in full.
+ */
+mandel_session* mandel_session_create(
+    mandel_renderer* r,
+    const mandel_view_t* view,
+    const mandel_schedule_t* schedule )
+{
+  mandel_session* s = calloc( 1, sizeof( *s ) );
+  if ( !s ) return NULL;
+
+  size_t pixels = ( size_t ) bitmap_width( view->bm ) * bitmap_height( view->bm );
+
+  s->renderer = r;
+  s->schedule = *schedule;
+  s->view = *view;
+  s->previous = malloc( sizeof( int ) * pixels );
+  s->known = calloc( pixels, 1 );
+
+  if ( !s->previous || !s->known )
+  {
+    mandel_session_delete( s );
+    return NULL;
+  }
+
+  // the saved orbits would go stale as soon as the view moves
+  s->view.orbits = NULL;
+  s->view.known = s->known;
+
+  session_render( s );
+
+  return s;
+}
+
+void mandel_session_delete( mandel_session* s )
+{
+  free( s->previous );
+  free( s->known );
+  free( s );
+}
+
+const mandel_view_t* mandel_session_view( mandel_session* s )
+{
+  return &s->view;
+}
+
+/**
+ * Move the view by dx, dy pixels. Returns how many pixels had to be rendered.
+ */
+int mandel_session_pan( mandel_session* s, int dx, int dy )
+{
+  int width = bitmap_width( s->view.bm );
+  int height = bitmap_height( s->view.bm );
+
+  double pixel_width = ( s->view.x_max - s->view.x_min ) / width;
+  double pixel_height = ( s->view.y_max - s->view.y_min ) / height;
+
+  session_step( s );
+
+  s->view.x_min += dx * pixel_width;
+  s->view.x_max += dx * pixel_width;
+  s->view.y_min += dy * pixel_height;
+  s->view.y_max += dy * pixel_height;
+
+  // new pixel i, j is old pixel i + dx, j + dy, so copy over whichever part
+  // of each row is still on screen
+  int* pixels = bitmap_data( s->view.bm );
+
+  int col_start = dx < 0 ? -dx : 0;
+  int col_end = dx > 0 ? width - dx : width;
+
+  int j;
+  for ( j = 0; j < height && col_start < col_end; j++ )
+  {
+    int old_j = j + dy;
+    if ( old_j < 0 || old_j >= height ) continue;
+
+    memcpy(
+        pixels + j * width + col_start,
+        s->previous + old_j * width + col_start + dx,
+        sizeof( int ) * ( col_end - col_start ) );
+
+    memset( s->known + j * width + col_start, 1, col_end - col_start );
+  }
+
+  return session_render( s );
+}
+
+/**
+ * Zoom in on the center of the view by an integer factor. Every factor'th
+ * pixel in each direction lines up with a pixel of the last image.
+ * Returns how many pixels had to be rendered.
+ */
+int mandel_session_zoom_in( mandel_session* s, int factor )
+{
+  if ( factor < 1 ) factor = 1;
+
+  int width = bitmap_width( s->view.bm );
+  int height = bitmap_height( s->view.bm );
+
+  double pixel_width = ( s->view.x_max - s->view.x_min ) / width;
+  double pixel_height = ( s->view.y_max - s->view.y_min ) / height;
+
+  // the new view starts on a whole pixel of the old one
+  int offset_x = ( width - width / factor ) / 2;
+  int offset_y = ( height - height / factor ) / 2;
+
+  session_step( s );
+
+  s->view.x_min += offset_x * pixel_width;
+  s->view.y_min += offset_y * pixel_height;
+  s->view.x_max = s->view.x_min + width * pixel_width / factor;
+  s->view.y_max = s->view.y_min + height * pixel_height / factor;
+
+  int* pixels = bitmap_data( s->view.bm );
+
+  int i, j;
+  for ( j = 0; j < height; j += factor )
+  {
+    for ( i = 0; i < width; i += factor )
+    {
+      int old = ( offset_y + j / factor ) * width + offset_x + i / factor;
+
+      pixels[ j * width + i ] = s->previous[ old ];
+      s->known[ j * width + i ] = 1;
+    }
+  }
+
+  return session_render( s );
+}
+
+/**
+ * Zoom out from the center of the view by an integer factor. The old image
+ * shrinks into a block in the middle of the new one, and only the border
+ * around it is rendered. Returns how many pixels had to be rendered.
+ */
+int mandel_session_zoom_out( mandel_session* s, int factor )
+{
+  if ( factor < 1 ) factor = 1;
+
+  int width = bitmap_width( s->view.bm );
+  int height = bitmap_height( s->view.bm );
+
+  double pixel_width = ( s->view.x_max - s->view.x_min ) / width * factor;
+  double pixel_height = ( s->view.y_max - s->view.y_min ) / height * factor;
+
+  // the old view starts on a whole pixel of the new one
+  int offset_x = ( width - width / factor ) / 2;
+  int offset_y = ( height - height / factor ) / 2;
+
+  session_step( s );
+
+  s->view.x_min -= offset_x * pixel_width;
+  s->view.y_min -= offset_y * pixel_height;
+  s->view.x_max = s->view.x_min + width * pixel_width;
+  s->view.y_max = s->view.y_min + height * pixel_height;
+
+  // new pixel i, j is old pixel ( i - offset_x ) * factor, ( j - offset_y ) * factor
+  int* pixels = bitmap_data( s->view.bm );
+
+  int i, j;
+  for ( j = offset_y; j < height && ( j - offset_y ) * factor < height; j++ )
+  {
+    for ( i = offset_x; i < width && ( i - offset_x ) * factor < width; i++ )
+    {
+      int old = ( j - offset_y ) * factor * width + ( i - offset_x ) * factor;
+
+      pixels[ j * width + i ] = s->previous[ old ];
+      s->known[ j * width + i ] = 1;
+    }
+  }
+
+  return session_render( s );
+}
+
+/**
+ * Keep the current image around as the last one, and forget which pixels
+ * are known, ready for the view to move.
+ */
+void session_step( mandel_session* s )
+{
+  size_t pixels = ( size_t ) bitmap_width( s->view.bm ) * bitmap_height( s->view.bm );
+
+  memcpy( s->previous, bitmap_data( s->view.bm ), sizeof( int ) * pixels );
+  memset( s->known, 0, pixels );
+}
+
+/**
+ * Render every pixel of the current view which isn't known yet, returning
+ * how many there were.
+ */
+int session_render( mandel_session* s )
+{
+  size_t pixels = ( size_t ) bitmap_width( s->view.bm ) * bitmap_height( s->view.bm );
+
+  int unknown = 0;
+  size_t i;
+  for ( i = 0; i < pixels; i++ )
+  {
+    if ( !s->known[ i ] ) unknown++;
+  }
+
+  if ( unknown == 0 ) return 0;
+
+  mandel_job* job = mandel_render( s->renderer, &s->view, &s->schedule, NULL, NULL );
+  mandel_job_wait( job );
+  mandel_job_delete( job );
+
+  return unknown;
+}
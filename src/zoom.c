@@ -0,0 +1,207 @@
+#include <mandelbrot.h>
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * The exponential map of a zoom around one center: iteration counts on a
+ * grid which is even in angle along its columns and in the log of the
+ * distance from the center along its rows. Cells get bigger in step with
+ * their distance from the center, the same way pixels do as a zoom goes out,
+ * so one map holds every frame of the zoom at (at least) full resolution,
+ * and costs about as much to compute as a few frames do.
+ */
+struct mandel_zoom
+{
+  double x_center;
+  double y_center;
+
+  // the distances from the center the map covers; closer points are
+  // computed directly, since the log of the distance runs off to -infinity
+  double r_min;
+  double r_max;
+
+  // the angle between columns, which is also the step in log distance
+  // between rows
+  double step;
+
+  int columns;
+  int rows;
+  int max;
+
+  // rows * columns counts, one row per distance
+  int* counts;
+
+  // the direction of every column
+  double* cos_column;
+  double* sin_column;
+};
+
+// the radius, in pixels of the smallest frame, of the disk in the middle of
+// every frame which is computed directly rather than looked up
+#define ZOOM_CORE_PIXELS 8
+
+void zoom_compute_row( void* arg, int row );
+int zoom_lookup( const void* arg, double x, double y, int max );
+
+/**
+ * Compute the map for a zoom around x_center, y_center covering every frame
+ * of width by height pixels whose scale (half the width of the view) lies
+ * between scale_min and scale_max, one row at a time on the renderer's pool.
+ */
+mandel_zoom* mandel_zoom_create(
+    mandel_renderer* r,
+    double x_center,
+    double y_center,
+    double scale_min,
+    double scale_max,
+    int width,
+    int height,
+    int max )
+{
+  if ( scale_min <= 0 || scale_max < scale_min || width < 1 || height < 1 ) return NULL;
+
+  mandel_zoom* z = calloc( 1, sizeof( *z ) );
+  if ( !z ) return NULL;
+
+  int pixels = width > height ? width : height;
+
+  // the corners of a frame are where its pixels are smallest next to the
+  // cells, and a cell there is as wide as a pixel. An even number of columns
+  // puts every column's reflection in the real axis on another column
+  z->columns = 2 * ( int ) ceil( M_PI * M_SQRT2 * pixels / 2 );
+  z->step = 2 * M_PI / z->columns;
+
+  z->x_center = x_center;
+  z->y_center = y_center;
+  z->r_min = ZOOM_CORE_PIXELS * 2 * scale_min / pixels;
+  z->r_max = scale_max * M_SQRT2;
+  z->rows = ( int ) ceil( log( z->r_max / z->r_min ) / z->step ) + 1;
+  z->max = max;
+
+  z->counts = malloc( sizeof( int ) * ( size_t ) z->rows * z->columns );
+  z->cos_column = malloc( sizeof( double ) * z->columns );
+  z->sin_column = malloc( sizeof( double ) * z->columns );
+
+  if ( !z->counts || !z->cos_column || !z->sin_column )
+  {
+    mandel_zoom_delete( z );
+    return NULL;
+  }
+
+  int a;
+  for ( a = 0; a < z->columns; a++ )
+  {
+    z->cos_column[ a ] = cos( a * z->step );
+    z->sin_column[ a ] = sin( a * z->step );
+  }
+
+  mandel_job* job = mandel_render_rows( r, z->rows, zoom_compute_row, z );
+  mandel_job_wait( job );
+  mandel_job_delete( job );
+
+  return z;
+}
+
+void mandel_zoom_delete( mandel_zoom* z )
+{
+  free( z->counts );
+  free( z->cos_column );
+  free( z->sin_column );
+  free( z );
+}
+
+/**
+ * How many points the map took to compute.
+ */
+size_t mandel_zoom_points( mandel_zoom* z )
+{
+  size_t points = ( size_t ) z->rows * z->columns;
+
+  return z->y_center == 0 ? points / 2 + z->rows : points;
+}
+
+/**
+ * Render a frame of the zoom into the view's bitmap on the renderer, looking
+ * every pixel up in the map except for the few too close to the center, or
+ * too far from it, to be in there. The view should be centered on the zoom.
+ * It's rendered like any other view, with or without histograms, but never
+ * by distance estimation.
+ */
+void mandel_zoom_frame( mandel_zoom* z, mandel_renderer* r, const mandel_view_t* view )
+{
+  mandel_view_t frame = *view;
+  frame.lookup = zoom_lookup;
+  frame.lookup_data = z;
+
+  // looking a pixel up costs about the same everywhere
+  mandel_schedule_t schedule = {
+    .thread_count = mandel_renderer_threads( r ),
+    .work_stealing = true,
+    .tile_rows = 1
+  };
+
+  mandel_job* job = mandel_render( r, &frame, &schedule, NULL, NULL );
+  mandel_job_wait( job );
+  mandel_job_delete( job );
+}
+
+/**
+ * Compute one row of the map, which is every direction at one distance from
+ * the center. When the center is on the real axis, the lower half of the
+ * row is the reflection of the upper half.
+ */
+void zoom_compute_row( void* arg, int row )
+{
+  mandel_zoom* z = arg;
+
+  double r = z->r_min * exp( row * z->step );
+  int* counts = z->counts + ( size_t ) row * z->columns;
+
+  bool mirrored = z->y_center == 0;
+  int last = mirrored ? z->columns / 2 : z->columns - 1;
+
+  int a;
+  for ( a = 0; a <= last; a++ )
+  {
+    counts[ a ] = mandel_escape_iterations(
+        z->x_center + r * z->cos_column[ a ],
+        z->y_center + r * z->sin_column[ a ],
+        z->max );
+  }
+
+  if ( !mirrored ) return;
+
+  for ( a = last + 1; a < z->columns; a++ )
+  {
+    counts[ a ] = counts[ z->columns - a ];
+  }
+}
+
+/**
+ * The count at x, y, from the nearest cell of the map if it's covered, or
+ * computed if it isn't, capped at the frame's max.
+ */
+int zoom_lookup( const void* arg, double x, double y, int max )
+{
+  const mandel_zoom* z = arg;
+
+  double dx = x - z->x_center;
+  double dy = y - z->y_center;
+  double r = hypot( dx, dy );
+
+  if ( r < z->r_min || r > z->r_max )
+  {
+    return mandel_escape_iterations( x, y, max );
+  }
+
+  int row = ( int ) lround( log( r / z->r_min ) / z->step );
+  if ( row >= z->rows ) row = z->rows - 1;
+
+  double angle = atan2( dy, dx );
+  if ( angle < 0 ) angle += 2 * M_PI;
+
+  int column = ( int ) lround( angle / z->step ) % z->columns;
+
+  int iters = z->counts[ ( size_t ) row * z->columns + column ];
+  return iters > max ? max : iters;
+}